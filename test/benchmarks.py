@@ -7,6 +7,7 @@ import time
 from tvm import autotvm
 import sys
 import os
+import threading
 
 
 def genImage():
@@ -69,13 +70,320 @@ def benchmark(model, csv_file, input_fn=genImage, iters=100, warmup=10):
                                                       jit_time, iters / tvm_time))
 
 
+def benchmark_threads(model, input_fn=genImage, iters=20, warmup=10,
+                      thread_counts=(1, 2, 4, 8)):
+    """Measures TVM throughput with several threads sharing one traced model"""
+    with torch.no_grad():
+        inputs = input_fn()
+        d = os.path.dirname(os.path.abspath(__file__))
+        fn = os.path.join(d, "autotvm_tuning.log")
+        with autotvm.apply_history_best(fn):
+            torch_tvm.enable(opt_level=3)
+            trace_tvm = torch.jit.trace(model, inputs)
+            for _ in range(warmup):
+                _ = trace_tvm(*inputs)
+
+            def worker():
+                for _ in range(iters):
+                    _ = trace_tvm(*inputs)
+
+            base = None
+            for num_threads in thread_counts:
+                threads = [threading.Thread(target=worker)
+                           for _ in range(num_threads)]
+                start = time.time()
+                for t in threads:
+                    t.start()
+                for t in threads:
+                    t.join()
+                throughput = num_threads * iters / (time.time() - start)
+                if base is None:
+                    base = throughput
+                print("{} threads: {:.2f} iter/s ({:.2f}x)".format(
+                    num_threads, throughput, throughput / base))
+            torch_tvm.disable()
+
+
+def benchmark_constants(model, input_fn=genImage, iters=100, warmup=10):
+    """Compares per-call time with weights passed as inputs on every call
+    against weights bound as constants at build time.  Both variants trace a
+    closure over the model; the first also passes its weights as trace
+    inputs, which the tracer records as graph inputs."""
+    with torch.no_grad():
+        inputs = input_fn()
+        weights = list(model.parameters()) + list(model.buffers())
+        d = os.path.dirname(os.path.abspath(__file__))
+        fn = os.path.join(d, "autotvm_tuning.log")
+        with autotvm.apply_history_best(fn):
+            torch_tvm.enable(opt_level=3)
+            traces = [
+                ("weights as inputs",
+                 torch.jit.trace(lambda x, *w: model(x), inputs + weights),
+                 inputs + weights),
+                ("weights as constants",
+                 torch.jit.trace(lambda x: model(x), inputs),
+                 inputs),
+            ]
+            for name, trace_tvm, args in traces:
+                for _ in range(warmup):
+                    _ = trace_tvm(*args)
+                start = time.time()
+                for _ in range(iters):
+                    _ = trace_tvm(*args)
+                per_call = (time.time() - start) / iters
+                print("{}: {:.3f} ms/iter".format(name, 1000 * per_call))
+            torch_tvm.disable()
+
+
+class MixedModel(torch.nn.Module):
+    """Alternates convolutions compiled by TVM with softmax, which is not
+    supported and runs in the JIT on ATen's intra-op pool"""
+
+    def __init__(self, channels=64):
+        super(MixedModel, self).__init__()
+        self.conv1 = torch.nn.Conv2d(channels, channels, 3, padding=1)
+        self.conv2 = torch.nn.Conv2d(channels, channels, 3, padding=1)
+
+    def forward(self, x):
+        x = torch.relu(self.conv1(x))
+        x = torch.softmax(x, 1)
+        x = torch.relu(self.conv2(x))
+        return torch.softmax(x, 1)
+
+
+def benchmark_thread_pool(model, input_fn, iters=200, warmup=10):
+    """Compares mean and tail latency of a mixed TVM/JIT model with TVM using
+    its own thread pool against TVM sized to ATen's pool"""
+    with torch.no_grad():
+        inputs = input_fn()
+        for thread_pool in ("tvm", "aten"):
+            torch_tvm.enable(opt_level=3, thread_pool=thread_pool)
+            trace_tvm = torch.jit.trace(model, inputs)
+            for _ in range(warmup):
+                _ = trace_tvm(*inputs)
+            latencies = []
+            for _ in range(iters):
+                start = time.time()
+                _ = trace_tvm(*inputs)
+                latencies.append(time.time() - start)
+            latencies.sort()
+            print("thread_pool={}: mean {:.3f} ms, p99 {:.3f} ms".format(
+                thread_pool,
+                1000 * sum(latencies) / iters,
+                1000 * latencies[int(0.99 * (iters - 1))]))
+            torch_tvm.disable()
+
+
+def benchmark_conversion(sizes=(1250, 2500, 5000, 10000)):
+    """Times the conversion of synthetic subgraphs of increasing size to
+    Relay, which should scale linearly in the number of nodes"""
+
+    def deep(x, y, n):
+        for _ in range(n):
+            x = x + y
+        return x
+
+    def wide(x, y, n):
+        # Many short chains joined at the end
+        out = x
+        for _ in range(n // 3):
+            out = out + (x * y + y)
+        return out
+
+    inputs = [torch.rand(8), torch.rand(8)]
+    torch_tvm.enable()
+    for name, fn in (("deep", deep), ("wide", wide)):
+        for size in sizes:
+            trace = torch.jit.trace(lambda x, y: fn(x, y, size), inputs)
+            graph = trace.graph_for(*inputs)
+            start = time.time()
+            handle = torch_tvm._push_relay_expr(graph, inputs)
+            elapsed = time.time() - start
+            torch_tvm._pop_relay_expr(handle)
+            print("{} {} nodes: {:.3f} s ({:.1f} us/node)".format(
+                name, size, elapsed, 1e6 * elapsed / size))
+    torch_tvm.disable()
+
+
+def quantize_resnet(model, scale=0.05, zero_point=64):
+    """Returns a function running a torchvision ResNet with quantized
+    operators.  Batch norms are folded into the convolutions, whose weights
+    are quantized per tensor.  Pooling and the classifier run in float."""
+    def fold(conv, bn):
+        std = (bn.running_var + bn.eps).sqrt()
+        weight = conv.weight * (bn.weight / std).reshape(-1, 1, 1, 1)
+        bias = bn.bias - bn.running_mean * bn.weight / std
+        qweight = torch.quantize_linear(
+            weight, weight.abs().max().item() / 127, 0, torch.qint8)
+        args = (list(conv.stride), list(conv.padding), list(conv.dilation),
+                conv.groups)
+        return torch.ops.quantized.conv_prepack(qweight, bias, *args), args
+
+    def conv(q, packed, relu):
+        weight, args = packed
+        q = torch.ops.quantized.conv2d(q, weight, *args, scale, zero_point)
+        return torch.ops.quantized.relu(q) if relu else q
+
+    def quantize(x):
+        return torch.quantize_linear(x, scale, zero_point, torch.quint8)
+
+    with torch.no_grad():
+        stem = fold(model.conv1, model.bn1)
+        blocks = []
+        for layer in (model.layer1, model.layer2, model.layer3, model.layer4):
+            for block in layer:
+                downsample = None
+                if block.downsample is not None:
+                    downsample = fold(block.downsample[0], block.downsample[1])
+                blocks.append((fold(block.conv1, block.bn1),
+                               fold(block.conv2, block.bn2), downsample))
+
+    def forward(x):
+        q = conv(quantize(x), stem, True)
+        q = quantize(model.maxpool(q.dequantize()))
+        for conv1, conv2, downsample in blocks:
+            out = conv(conv(q, conv1, True), conv2, False)
+            identity = q if downsample is None else conv(q, downsample, False)
+            q = torch.ops.quantized.relu(
+                torch.ops.quantized.add(out, identity, scale, zero_point))
+        x = torch.flatten(model.avgpool(q.dequantize()), 1)
+        return model.fc(x)
+
+    return forward
+
+
+def benchmark_quantized(model, input_fn=genImage, iters=100, warmup=10):
+    """Compares a quantized ResNet run by fbgemm in the JIT against the same
+    network lowered through Relay's QNN operators"""
+    forward = quantize_resnet(model)
+    inputs = input_fn()
+    with torch.no_grad():
+        for name in ("fbgemm", "tvm"):
+            if name == "tvm":
+                torch_tvm.enable(opt_level=3)
+            trace = torch.jit.trace(forward, inputs)
+            for _ in range(warmup):
+                _ = trace(*inputs)
+            start = time.time()
+            for _ in range(iters):
+                _ = trace(*inputs)
+            per_call = (time.time() - start) / iters
+            print("{}: {:.3f} ms/iter".format(name, 1000 * per_call))
+        torch_tvm.disable()
+
+
+def benchmark_training(model, input_fn=genImage, iters=20, warmup=3):
+    """Compares the throughput of training steps (forward, backward and an
+    SGD update) in the JIT against TVM compiled forward and backward
+    kernels.  Batch norm statistics are frozen, as TVM only supports batch
+    norm in inference mode."""
+    model.eval()
+    inputs = input_fn()
+    optimizer = torch.optim.SGD(model.parameters(), lr=0.001)
+    for name in ("jit", "tvm"):
+        if name == "tvm":
+            torch_tvm.enable(opt_level=3)
+        trace = torch.jit.trace(model, inputs)
+
+        def step():
+            optimizer.zero_grad()
+            trace(*inputs).sum().backward()
+            optimizer.step()
+
+        for _ in range(warmup):
+            step()
+        start = time.time()
+        for _ in range(iters):
+            step()
+        throughput = iters / (time.time() - start)
+        print("{}: {:.2f} steps/s".format(name, throughput))
+        torch_tvm.disable()
+
+
+def benchmark_ops(model, input_fn=genImage, warmup=10, rows=20):
+    """Prints the time of each TVM kernel next to the JIT operators it
+    replaces, showing which layers TVM speeds up or slows down."""
+    inputs = input_fn()
+    with torch.no_grad():
+        trace_jit = torch.jit.trace(model, inputs)
+        for _ in range(warmup):
+            _ = trace_jit(*inputs)
+        with profile() as prof:
+            _ = trace_jit(*inputs)
+        print("JIT operators")
+        print(prof.key_averages().table(
+            sort_by="cpu_time_total", row_limit=rows))
+
+        torch_tvm.enable(opt_level=3, profile_ops=True)
+        trace_tvm = torch.jit.trace(model, inputs)
+        for _ in range(warmup):
+            _ = trace_tvm(*inputs)
+        with torch_tvm.profile() as prof:
+            _ = trace_tvm(*inputs)
+        torch_tvm.disable()
+        torch_tvm.enable(profile_ops=False)
+        torch_tvm.disable()
+        kernels = [e for e in prof.key_averages() if e.key.startswith("TVM::")]
+        kernels.sort(key=lambda e: e.cpu_time_total, reverse=True)
+        print("TVM kernels")
+        for e in kernels[:rows]:
+            print("{:>10.1f}us  {}".format(e.cpu_time_total, e.key))
+
+
 def run_benchmark(csv_file):
     model = resnet18(True)
     model.eval()
     benchmark(model, csv_file)
 
 
+def run_benchmark_threads():
+    model = resnet18(True)
+    model.eval()
+    benchmark_threads(model)
+
+
+def run_benchmark_constants():
+    model = resnet18(True)
+    model.eval()
+    benchmark_constants(model)
+
+
+def run_benchmark_training():
+    model = resnet18(True)
+    benchmark_training(model)
+
+
+def run_benchmark_quantized():
+    model = resnet18(True)
+    model.eval()
+    benchmark_quantized(model)
+
+
+def run_benchmark_ops():
+    model = resnet18(True)
+    model.eval()
+    benchmark_ops(model)
+
+
+def run_benchmark_thread_pool():
+    model = MixedModel()
+    model.eval()
+    benchmark_thread_pool(model, lambda: [torch.rand(1, 64, 56, 56)])
+
+
 if __name__ == "__main__":
+    benchmarks = {
+        "--ops": run_benchmark_ops,
+        "--training": run_benchmark_training,
+        "--quantized": run_benchmark_quantized,
+        "--conversion": benchmark_conversion,
+        "--thread_pool": run_benchmark_thread_pool,
+        "--constants": run_benchmark_constants,
+        "--threads": run_benchmark_threads,
+    }
+    if len(sys.argv) == 2 and sys.argv[1] in benchmarks:
+        benchmarks[sys.argv[1]]()
+        sys.exit(0)
     csv_file = None
     if len(sys.argv) == 3 and sys.argv[1] == "--csv":
         csv_file = sys.argv[2]
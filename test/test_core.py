@@ -1,9 +1,21 @@
+import os
+import shutil
+import tempfile
+import threading
+import time
 import unittest
 from test.util import TVMTest
 import torch
 import torch_tvm
 
 
+# softmax is not supported, splitting the graph in two groups
+def two_groups(a, b, c):
+    x = torch.relu(a * b + c)
+    x = torch.softmax(x, 0)
+    return torch.relu(x * b + c)
+
+
 class TestCore(TVMTest):
     def test_get_handle(self):
         shape = 8
@@ -102,3 +114,566 @@ class TestCore(TVMTest):
         torch_tvm.disable()
 
         torch.testing.assert_allclose(jit_out, tvm_out, rtol=0.01, atol=0.01)
+
+    @TVMTest.given(shape=TVMTest.rand_shape(rank=1))
+    def test_disk_cache(self, shape):
+        x = torch.rand(shape)
+        y = torch.rand(shape)
+        z = torch.rand(shape)
+
+        def add(a, b, c):
+            return a + b + c
+
+        inputs = [x, y, z]
+
+        trace_jit = torch.jit.trace(add, inputs)
+        jit_out = trace_jit(*inputs)
+
+        cache_dir = tempfile.mkdtemp()
+        try:
+            torch_tvm.enable(cache_dir=cache_dir)
+            trace_tvm = torch.jit.trace(add, inputs)
+            tvm_out = trace_tvm(*inputs)
+            entries = [e for e in os.listdir(cache_dir) if not e.startswith(".")]
+            assert len(entries) == 1, "Expected one cache entry, got {}".format(
+                entries)
+
+            # A fresh trace must be served from the disk cache
+            trace_tvm = torch.jit.trace(add, inputs)
+            cached_out = trace_tvm(*inputs)
+            torch_tvm.disable()
+            torch.testing.assert_allclose(jit_out, tvm_out, rtol=0.01, atol=0.01)
+            torch.testing.assert_allclose(
+                jit_out, cached_out, rtol=0.01, atol=0.01)
+        finally:
+            shutil.rmtree(cache_dir)
+
+    @TVMTest.given(shape=TVMTest.rand_shape(rank=1))
+    def test_export(self, shape):
+        x = torch.rand(shape)
+        y = torch.rand(shape)
+        z = torch.rand(shape)
+
+        def add(a, b, c):
+            return a * b + c
+
+        inputs = [x, y, z]
+
+        trace_jit = torch.jit.trace(add, inputs)
+        jit_out = trace_jit(*inputs)
+
+        fd, path = tempfile.mkstemp(suffix=".tvm")
+        os.close(fd)
+        try:
+            torch_tvm.enable()
+            trace_tvm = torch.jit.trace(add, inputs)
+            count = torch_tvm.export(trace_tvm, [inputs], path)
+            assert count == 1, "Expected one exported kernel, got {}".format(count)
+
+            # Kernels already compiled are exported from the cache
+            count = torch_tvm.export(trace_tvm, [inputs], path)
+            assert count == 1, "Expected one exported kernel, got {}".format(count)
+
+            assert torch_tvm.load(path) == 1
+            trace_tvm = torch.jit.trace(add, inputs)
+            loaded_out = trace_tvm(*inputs)
+            torch_tvm.disable()
+            torch.testing.assert_allclose(
+                jit_out, loaded_out, rtol=0.01, atol=0.01)
+        finally:
+            os.remove(path)
+
+    @TVMTest.given(shape=TVMTest.rand_shape(rank=1))
+    def test_allocator(self, shape):
+        x = torch.rand(shape)
+        y = torch.rand(shape)
+        z = torch.rand(shape)
+
+        def add(a, b, c):
+            return a + b + c
+
+        inputs = [x, y, z]
+
+        torch_tvm.enable()
+        trace_tvm = torch.jit.trace(add, inputs)
+        for _ in range(3):
+            _ = trace_tvm(*inputs)
+        warm = torch_tvm.allocator_stats()
+        for _ in range(10):
+            _ = trace_tvm(*inputs)
+        # Outputs dropped by another thread return to this thread's blocks
+        for _ in range(10):
+            outs = [trace_tvm(*inputs)]
+            t = threading.Thread(target=outs.clear)
+            t.start()
+            t.join()
+        torch_tvm.disable()
+        stats = torch_tvm.allocator_stats()
+        # TVM storage comes from the arena
+        assert warm["allocations"] > 0
+        assert stats["allocations"] == warm["allocations"], \
+            "Expected no allocations once warm, got {}".format(
+                stats["allocations"] - warm["allocations"])
+        assert stats["used_bytes"] <= stats["reserved_bytes"]
+
+    @TVMTest.given(shape=TVMTest.rand_shape(rank=2))
+    def test_handoff(self, shape):
+        def mul_add(a, b, c):
+            return a * b + c
+
+        inputs = [torch.rand(shape) for _ in range(3)]
+        trace_jit = torch.jit.trace(mul_add, inputs)
+        jit_out = trace_jit(trace_jit(*inputs), inputs[1], inputs[2])
+
+        torch_tvm.enable()
+        trace_tvm = torch.jit.trace(mul_add, inputs)
+        # The second call binds the array the first one computed, without
+        # converting it
+        first_out = trace_tvm(*inputs)
+        assert torch_tvm._is_tvm_array(first_out)
+        tvm_out = trace_tvm(first_out, inputs[1], inputs[2])
+        torch_tvm.disable()
+        assert torch_tvm._is_tvm_array(tvm_out)
+        # Views are converted as any other tensor
+        assert not torch_tvm._is_tvm_array(tvm_out[1:])
+        torch.testing.assert_allclose(jit_out, tvm_out, rtol=0.01, atol=0.01)
+        # Outputs behave as any other tensor
+        tvm_out.resize_(tvm_out.numel() * 2)
+
+    @TVMTest.given(shape=TVMTest.rand_shape(rank=2, min_dim=4))
+    def test_shared_workspace(self, shape):
+        inputs = [torch.rand(shape) for _ in range(3)]
+        trace_jit = torch.jit.trace(two_groups, inputs)
+        jit_out = trace_jit(*inputs)
+
+        torch_tvm.enable(shared_workspace=True)
+        trace_tvm = torch.jit.trace(two_groups, inputs)
+        outs = []
+
+        def worker():
+            outs.append(trace_tvm(*inputs))
+
+        # Each thread runs in its own workspace
+        threads = [threading.Thread(target=worker) for _ in range(2)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        stats = torch_tvm.allocator_stats()
+        # The runtimes of the exited threads are reclaimed by the next call,
+        # freeing their workspaces
+        outs.append(trace_tvm(*inputs))
+        reclaimed_stats = torch_tvm.allocator_stats()
+        torch_tvm.disable()
+        torch_tvm.enable(shared_workspace=False)
+        torch_tvm.disable()
+        for tvm_out in outs:
+            torch.testing.assert_allclose(
+                jit_out, tvm_out, rtol=0.01, atol=0.01)
+        assert stats["workspace_bytes"] > 0
+        assert reclaimed_stats["workspace_bytes"] < stats["workspace_bytes"]
+
+    @TVMTest.given(shape=TVMTest.rand_shape(rank=1))
+    def test_profile_ops(self, shape):
+        inputs = [torch.rand(shape) for _ in range(3)]
+        trace_jit = torch.jit.trace(two_groups, inputs)
+        jit_out = trace_jit(*inputs)
+
+        torch_tvm.enable(profile_ops=True)
+        trace_tvm = torch.jit.trace(two_groups, inputs)
+        trace_tvm(*inputs)
+        with torch_tvm.profile() as prof:
+            tvm_out = trace_tvm(*inputs)
+        torch_tvm.disable()
+        torch_tvm.enable(profile_ops=False)
+        torch_tvm.disable()
+
+        torch.testing.assert_allclose(jit_out, tvm_out, rtol=0.01, atol=0.01)
+        groups = [e for e in prof.function_events if e.name == "TVM"]
+        kernels = [e for e in prof.function_events
+                   if e.name.startswith("TVM::")]
+        assert len(groups) == 2
+        assert kernels
+        assert not any(e.name.startswith("TVM::kernels#") for e in kernels)
+        # Kernels nest in their group and name the JIT nodes they run
+        for k in kernels:
+            assert any(g.cpu_interval.start <= k.cpu_interval.start and
+                       k.cpu_interval.end <= g.cpu_interval.end
+                       for g in groups)
+        assert any("aten::relu" in k.name for k in kernels)
+
+    @TVMTest.given(shape=TVMTest.rand_shape(rank=1))
+    def test_async_compile(self, shape):
+        x = torch.rand(shape)
+        y = torch.rand(shape)
+        z = torch.rand(shape)
+
+        def add(a, b, c):
+            return a + b + c
+
+        inputs = [x, y, z]
+
+        trace_jit = torch.jit.trace(add, inputs)
+        jit_out = trace_jit(*inputs)
+
+        torch_tvm.enable(async_compile=True, compile_threads=2)
+        trace_tvm = torch.jit.trace(add, inputs)
+        # Outputs must match whether they come from the JIT fallback or
+        # from the kernel built in the background
+        for _ in range(10):
+            tvm_out = trace_tvm(*inputs)
+            torch.testing.assert_allclose(jit_out, tvm_out, rtol=0.01, atol=0.01)
+            time.sleep(0.1)
+        torch_tvm.disable()
+
+    @TVMTest.given(shape=TVMTest.rand_shape(rank=1))
+    def test_tiered_compile(self, shape):
+        x = torch.rand(shape)
+        y = torch.rand(shape)
+        z = torch.rand(shape)
+
+        def add(a, b, c):
+            return a * b + c
+
+        inputs = [x, y, z]
+
+        trace_jit = torch.jit.trace(add, inputs)
+        jit_out = trace_jit(*inputs)
+
+        torch_tvm.enable(opt_level=3, hot_threshold=3, tier0_opt_level=0)
+        trace_tvm = torch.jit.trace(add, inputs)
+        tiers = set()
+        for _ in range(50):
+            tvm_out = trace_tvm(*inputs)
+            torch.testing.assert_allclose(jit_out, tvm_out, rtol=0.01, atol=0.01)
+            specs = [s for s in torch_tvm.spec_stats()
+                     if s["shapes"] == [list(shape)] * 3]
+            tiers.update(s["tier"] for s in specs)
+            if 2 in tiers:
+                break
+            time.sleep(0.1)
+        torch_tvm.disable()
+        assert 1 in tiers, "Expected a baseline kernel first"
+        assert 2 in tiers, "Expected the hot spec to be re-optimized"
+
+    @TVMTest.given(shape=TVMTest.rand_shape(rank=1))
+    def test_profile_dispatch(self, shape):
+        x = torch.rand(shape)
+        y = torch.rand(shape)
+        z = torch.rand(shape)
+
+        def add(a, b, c):
+            return a + b + c
+
+        inputs = [x, y, z]
+
+        trace_jit = torch.jit.trace(add, inputs)
+        jit_out = trace_jit(*inputs)
+
+        table_dir = tempfile.mkdtemp()
+        try:
+            table = os.path.join(table_dir, "dispatch.txt")
+            torch_tvm.enable(profile_runs=3, dispatch_table=table)
+            trace_tvm = torch.jit.trace(add, inputs)
+            before = torch_tvm.fallback_stats()
+            # Both backends are timed on alternating calls before deciding
+            for _ in range(10):
+                tvm_out = trace_tvm(*inputs)
+                torch.testing.assert_allclose(
+                    jit_out, tvm_out, rtol=0.01, atol=0.01)
+            torch_tvm.disable()
+            after = torch_tvm.fallback_stats()
+            # Interpreter samples are not fallbacks
+            assert after["profile_calls"] > before["profile_calls"]
+            entries = [e for e in torch_tvm.dispatch_table()
+                       if "aten::add" in e["ops"]]
+            assert len(entries) >= 1, "Expected a dispatch decision"
+            assert entries[0]["backend"] in ("tvm", "jit")
+            with open(table) as f:
+                lines = f.readlines()
+            assert any(entries[0]["key"] == l.split()[0] for l in lines)
+        finally:
+            shutil.rmtree(table_dir)
+
+    @TVMTest.given(shape=TVMTest.rand_shape(rank=1))
+    def test_min_group_size(self, shape):
+        inputs = [torch.rand(shape) for _ in range(3)]
+
+        def add(a, b, c):
+            return a + b
+
+        def mul_add(a, b, c):
+            return a * b + c
+
+        torch_tvm.enable(min_group_size=2)
+        small = torch.jit.trace(add, inputs)
+        large = torch.jit.trace(mul_add, inputs)
+        small_graph = str(small.graph_for(*inputs))
+        large_graph = str(large.graph_for(*inputs))
+        torch_tvm.enable(group_filter=lambda g: False)
+        filtered = torch.jit.trace(mul_add, inputs)
+        filtered_graph = str(filtered.graph_for(*inputs))
+        torch_tvm.disable()
+        assert "tvm::CompilationGroup" not in small_graph, small_graph
+        assert "tvm::CompilationGroup" in large_graph, large_graph
+        assert "tvm::CompilationGroup" not in filtered_graph, filtered_graph
+        torch.testing.assert_allclose(small(*inputs), add(*inputs))
+
+    @TVMTest.given(shape=TVMTest.rand_shape(rank=2))
+    def test_inplace(self, shape):
+        def update(a, b, c):
+            return a.add_(b * c).relu_()
+
+        def update_and_read(a, b, c):
+            a.add_(b).relu_()
+            return a * c
+
+        for fn in (update, update_and_read):
+            inputs = [torch.rand(shape) - 0.5 for _ in range(3)]
+            jit_inputs = [x.clone() for x in inputs]
+            trace_jit = torch.jit.trace(fn, [x.clone() for x in inputs])
+            jit_out = trace_jit(*jit_inputs)
+
+            torch_tvm.enable()
+            trace_tvm = torch.jit.trace(fn, [x.clone() for x in inputs])
+            tvm_out = trace_tvm(*inputs)
+            torch_tvm.disable()
+            # The update is visible through the input
+            torch.testing.assert_allclose(jit_out, tvm_out, rtol=0.01, atol=0.01)
+            torch.testing.assert_allclose(
+                jit_inputs[0], inputs[0], rtol=0.01, atol=0.01)
+            if fn is update:
+                assert tvm_out.data_ptr() == inputs[0].data_ptr()
+
+    @TVMTest.given(shape=TVMTest.rand_shape(rank=2))
+    def test_inplace_read_outside(self, shape):
+        # The update is only read by softmax, which is not in the group
+        def update(a, b, c):
+            a.add_(b * c)
+            return torch.softmax(a, 0)
+
+        inputs = [torch.rand(shape) - 0.5 for _ in range(3)]
+        jit_inputs = [x.clone() for x in inputs]
+        jit_out = torch.jit.script(update)(*jit_inputs)
+
+        torch_tvm.enable()
+        script_tvm = torch.jit.script(update)
+        tvm_out = script_tvm(*inputs)
+        graph = str(script_tvm.graph_for(*[x.clone() for x in inputs]))
+        torch_tvm.disable()
+        assert "tvm::CompilationGroupInPlace" in graph, graph
+        torch.testing.assert_allclose(jit_out, tvm_out, rtol=0.01, atol=0.01)
+        torch.testing.assert_allclose(
+            jit_inputs[0], inputs[0], rtol=0.01, atol=0.01)
+
+    @TVMTest.given(shape=TVMTest.rand_shape(rank=2))
+    def test_backward(self, shape):
+        def mul_add(a, b, c):
+            return torch.relu(a * b + c)
+
+        def grads(fn):
+            inputs = [torch.rand(shape, requires_grad=True) for _ in range(3)]
+            for x, x_ref in zip(inputs, ref_inputs):
+                x.data.copy_(x_ref.data)
+            fn(*inputs).sum().backward()
+            return [x.grad for x in inputs]
+
+        ref_inputs = [torch.rand(shape) - 0.5 for _ in range(3)]
+        trace_jit = torch.jit.trace(mul_add, ref_inputs)
+        jit_grads = grads(trace_jit)
+
+        torch_tvm.enable()
+        trace_tvm = torch.jit.trace(mul_add, ref_inputs)
+        # The first calls profile the graph
+        for _ in range(3):
+            tvm_grads = grads(trace_tvm)
+        torch_tvm.disable()
+        for jit_grad, tvm_grad in zip(jit_grads, tvm_grads):
+            torch.testing.assert_allclose(
+                jit_grad, tvm_grad, rtol=0.01, atol=0.01)
+
+    @TVMTest.given(shape=TVMTest.rand_shape(rank=2), examples=1)
+    def test_backward_async(self, shape):
+        def mul_add(a, b, c):
+            return torch.relu(a * b + c)
+
+        def grads(fn):
+            inputs = [x.clone().requires_grad_() for x in ref_inputs]
+            fn(*inputs).sum().backward()
+            return [x.grad for x in inputs]
+
+        ref_inputs = [torch.rand(shape) - 0.5 for _ in range(3)]
+        trace_jit = torch.jit.trace(mul_add, ref_inputs)
+        jit_grads = grads(trace_jit)
+
+        torch_tvm.enable(async_compile=True, compile_threads=2)
+        trace_tvm = torch.jit.trace(mul_add, ref_inputs)
+        # Grads must match whether they come from the JIT fallback or from
+        # the backward kernel built in the background
+        for _ in range(10):
+            for jit_grad, tvm_grad in zip(jit_grads, grads(trace_tvm)):
+                torch.testing.assert_allclose(
+                    jit_grad, tvm_grad, rtol=0.01, atol=0.01)
+            time.sleep(0.1)
+        stats = torch_tvm.cache_stats()
+        torch_tvm.disable()
+        # The forward and backward kernels of the group are accounted for
+        assert sum(g["kernels"] for g in stats["groups"]) >= 2
+
+    @TVMTest.given(shape=TVMTest.rand_shape(rank=1))
+    def test_concurrent_run(self, shape):
+        def add(a, b, c):
+            return a + b + c
+
+        inputs = [torch.rand(shape) for _ in range(3)]
+        trace_jit = torch.jit.trace(add, inputs)
+
+        torch_tvm.enable()
+        trace_tvm = torch.jit.trace(add, inputs)
+        errors = []
+
+        def worker():
+            try:
+                for _ in range(20):
+                    a, b, c = [torch.rand(shape) for _ in range(3)]
+                    torch.testing.assert_allclose(
+                        trace_jit(a, b, c), trace_tvm(a, b, c),
+                        rtol=0.01, atol=0.01)
+            except Exception as e:
+                errors.append(e)
+
+        threads = [threading.Thread(target=worker) for _ in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        torch_tvm.disable()
+        assert not errors, errors
+
+    def test_bucketing(self):
+        def add(a, b, c):
+            return a + b + c
+
+        inputs = [torch.rand(3, 8) for _ in range(3)]
+        trace_jit = torch.jit.trace(add, inputs)
+
+        for kwargs in [{"bucket_dims": [0]}, {"buckets": {0: [4, 16]}}]:
+            torch_tvm.enable(**kwargs)
+            trace_tvm = torch.jit.trace(add, inputs)
+            for batch in range(1, 20):
+                a, b, c = [torch.rand(batch, 8) for _ in range(3)]
+                jit_out = trace_jit(a, b, c)
+                tvm_out = trace_tvm(a, b, c)
+                assert tvm_out.shape == jit_out.shape
+                torch.testing.assert_allclose(
+                    jit_out, tvm_out, rtol=0.01, atol=0.01)
+            torch_tvm.disable()
+
+    def test_bucketing_reduction(self):
+        # Pooling averages over the spatial dims, where padding would leak
+        # into the result
+        def pool(a):
+            return torch.relu(
+                torch.nn.functional.adaptive_avg_pool2d(a, 1) * 2)
+
+        inputs = [torch.rand(1, 3, 5, 5)]
+        trace_jit = torch.jit.trace(pool, inputs)
+
+        torch_tvm.enable(buckets={2: [8], 3: [8]})
+        trace_tvm = torch.jit.trace(pool, inputs)
+        for size in range(3, 7):
+            a = torch.rand(1, 3, size, size)
+            torch.testing.assert_allclose(
+                trace_jit(a), trace_tvm(a), rtol=0.01, atol=0.01)
+        torch_tvm.disable()
+
+    def test_cache_budget(self):
+        def add(a, b, c):
+            return a + b + c
+
+        inputs = [torch.rand(4, 8) for _ in range(3)]
+        trace_jit = torch.jit.trace(add, inputs)
+
+        # A tiny budget keeps only the most recently used kernel
+        torch_tvm.enable(cache_budget=1)
+        trace_tvm = torch.jit.trace(add, inputs)
+        before = torch_tvm.cache_stats()["evictions"]
+        for batch in range(1, 6):
+            a, b, c = [torch.rand(batch, 8) for _ in range(3)]
+            torch.testing.assert_allclose(
+                trace_jit(a, b, c), trace_tvm(a, b, c), rtol=0.01, atol=0.01)
+        stats = torch_tvm.cache_stats()
+        cached_shapes = [s["shapes"] for s in torch_tvm.spec_stats()]
+        # The last spec is served by its kernel without recompiling
+        trace_tvm(a, b, c)
+        repeat_stats = torch_tvm.cache_stats()
+        torch_tvm.disable()
+        torch_tvm.enable(cache_budget=0)
+        torch_tvm.disable()
+
+        assert stats["evictions"] - before >= 4
+        # The most recently used kernel is the one kept
+        assert [[5, 8]] * 3 in cached_shapes, cached_shapes
+        assert repeat_stats["evictions"] == stats["evictions"]
+        assert sum(g["kernels"] for g in stats["groups"]) >= 1
+        assert all(g["bytes"] > 0 for g in stats["groups"])
+
+    @TVMTest.given(shape=TVMTest.rand_shape(rank=2))
+    def test_constant_tensors(self, shape):
+        w = torch.rand(shape)
+        x = torch.rand(shape)
+
+        # w is captured by the trace as a prim::Constant
+        def add_const(a):
+            return a + w + w
+
+        trace_jit = torch.jit.trace(add_const, [x])
+        jit_out = trace_jit(x)
+
+        torch_tvm.enable()
+        trace_tvm = torch.jit.trace(add_const, [x])
+        tvm_out = trace_tvm(x)
+        torch_tvm.disable()
+        torch.testing.assert_allclose(jit_out, tvm_out, rtol=0.01, atol=0.01)
+
+    @TVMTest.given(shape=TVMTest.rand_shape(rank=1))
+    def test_outputs_not_aliased(self, shape):
+        def add(a, b, c):
+            return a + b + c
+
+        inputs = [torch.rand(shape) for _ in range(3)]
+        other_inputs = [torch.rand(shape) for _ in range(3)]
+
+        torch_tvm.enable()
+        trace_tvm = torch.jit.trace(add, inputs)
+        out = trace_tvm(*inputs)
+        expected = out.clone()
+        # A second call must not overwrite the outputs of the first
+        _ = trace_tvm(*other_inputs)
+        torch_tvm.disable()
+        torch.testing.assert_allclose(out, expected)
+
+    @TVMTest.given(
+        shape=TVMTest.rand_shape(rank=4, min_dim=4),
+        examples=1
+    )
+    def test_fall_back_cached(self, shape):
+        inputs = torch.rand(shape)
+
+        def add(input):
+            return torch.add(input, 1, 2)
+
+        jit_out = torch.jit.script(add)(inputs)
+
+        torch_tvm.enable(strict=False)
+        tvm_script = torch.jit.script(add)
+        before = torch_tvm.fallback_stats()
+        for _ in range(3):
+            tvm_out = tvm_script(inputs)
+            torch.testing.assert_allclose(jit_out, tvm_out, rtol=0.01, atol=0.01)
+        after = torch_tvm.fallback_stats()
+        torch_tvm.disable()
+
+        # Conversion is only attempted once per input spec
+        assert after["conversion_failures"] - before["conversion_failures"] == 1
+        assert after["fallback_calls"] - before["fallback_calls"] == 3
@@ -451,6 +451,33 @@ class TestModels(TVMTest):
     def test_resnext101_32x8d(self):
         self.model_test(resnext101_32x8d)
 
+    def mixed_precision_test(self, constructor, precision):
+        model = constructor(True)
+        model.eval()
+        d = os.path.dirname(os.path.abspath(__file__))
+        fn = os.path.join(d, "cat.png")
+        image = io.imread(fn)[:, :, :3].transpose(2, 0, 1)
+        input_image = torch.unsqueeze(torch.Tensor(image), 0)
+        ref_out, tvm_out = self.runBoth(
+            model, input_image, enable_kwargs={"precision": precision})
+        # Report the accuracy cost against the fp32 JIT
+        delta = (ref_out - tvm_out).abs()
+        prob_delta = (F.softmax(ref_out, 1) - F.softmax(tvm_out, 1)).abs()
+        k = 5
+        overlap = len(set(ref_out.topk(k).indices.tolist()[0]) &
+                      set(tvm_out.topk(k).indices.tolist()[0]))
+        print("{} {}: max logit delta {:.4f}, mean logit delta {:.4f}, "
+              "max probability delta {:.4f}, top-{} overlap {}/{}".format(
+                  constructor.__name__, precision, delta.max().item(),
+                  delta.mean().item(), prob_delta.max().item(), k, overlap, k))
+        assert ref_out.argmax() == tvm_out.argmax()
+
+    def test_resnet18_fp16(self):
+        self.mixed_precision_test(resnet18, "fp16")
+
+    def test_resnet50_fp16(self):
+        self.mixed_precision_test(resnet50, "fp16")
+
     def test_resnetish(self):
         model = resnetish()
         model.eval()
@@ -461,6 +488,14 @@ class TestModels(TVMTest):
         ref_out, tvm_out = self.runBoth(model, input_image)
         torch.testing.assert_allclose(ref_out, tvm_out, rtol=0.01, atol=0.01)
 
+    def test_resnetish_nchwc(self):
+        model = resnetish()
+        model.eval()
+        input_image = torch.rand(1, 3, 224, 224)
+        ref_out, tvm_out = self.runBoth(
+            model, input_image, enable_kwargs={"opt_level": 3, "nchwc_block": 8})
+        torch.testing.assert_allclose(ref_out, tvm_out, rtol=0.01, atol=0.01)
+
 
 if __name__ == "__main__":
     unittest.main()
@@ -4,6 +4,7 @@ from torch.testing import FileCheck
 
 import torch
 import torch.nn.functional as F
+import torch_tvm
 import torch
 
 # test jit tvm operators
@@ -286,6 +287,69 @@ class TestOperators(TVMTest):
         ref_out, tvm_out = self.runBoth(reshape, input)
         assert torch.allclose(ref_out, tvm_out, rtol=0.01, atol=0.01)
 
+    @TVMTest.given(shape=TVMTest.rand_shape(rank=1))
+    def test_add_dtypes(self, shape):
+        def add(a, b, c):
+            return a + b + c
+
+        for dtype in [torch.int32, torch.int64, torch.float64]:
+            x, y, z = [torch.randint(0, 100, shape, dtype=dtype)
+                       for _ in range(3)]
+            before = torch_tvm.fallback_stats()
+            ref_out, tvm_out = self.runBoth(add, x, y, z)
+            after = torch_tvm.fallback_stats()
+            # The group ran a kernel built for dtype, not the interpreter
+            assert after == before, dtype
+            assert tvm_out.dtype == dtype
+            assert torch.allclose(ref_out, tvm_out)
+
+    @TVMTest.given(shape=TVMTest.rand_shape(rank=2, min_dim=4))
+    def test_quantized(self, shape):
+        x = torch.rand(shape)
+        y = torch.rand(shape)
+        W = torch.quantize_linear(
+            torch.rand(shape[1], shape[1]) - 0.5, 0.01, 0, torch.qint8)
+        W_prepack = torch.ops.quantized.fbgemm_linear_prepack(W)
+
+        def quantized(a, b):
+            qa = torch.quantize_linear(a, 0.01, 10, torch.quint8)
+            qb = torch.quantize_linear(b, 0.01, 20, torch.quint8)
+            qc = torch.ops.quantized.fbgemm_linear(qa, W_prepack, 0.05, 30)
+            qc = torch.ops.quantized.add(qc, qb, 0.05, 30)
+            return torch.ops.quantized.relu(qc).dequantize()
+
+        ref_out, tvm_out = self.runBoth(quantized, x, y)
+        # Rounding may differ by a quantization step
+        assert torch.allclose(ref_out, tvm_out, atol=0.11)
+
+    @TVMTest.given(
+        shape=TVMTest.rand_shape(rank=4, min_dim=4, max_dim=8),
+        groups=TVMTest.rand_int(1, 2),
+    )
+    def test_quantized_conv(self, shape, groups):
+        shape[1] = 4
+        x = torch.rand(shape)
+        W = torch.quantize_linear(
+            torch.rand(8, 4 // groups, 3, 3) - 0.5, 0.01, 0, torch.qint8)
+        bias = torch.rand(8)
+        stride, padding, dilation = [1, 1], [1, 1], [1, 1]
+        W_prepack = torch.ops.quantized.conv_prepack(
+            W, bias, stride, padding, dilation, groups)
+
+        def quantized(a):
+            qa = torch.quantize_linear(a, 0.01, 10, torch.quint8)
+            qc = torch.ops.quantized.conv2d(
+                qa, W_prepack, stride, padding, dilation, groups, 0.05, 30)
+            return torch.ops.quantized.relu(qc).dequantize()
+
+        before = torch_tvm.fallback_stats()
+        ref_out, tvm_out = self.runBoth(quantized, x)
+        after = torch_tvm.fallback_stats()
+        # The convolution was lowered, not left to the interpreter
+        assert after == before
+        # Rounding may differ by a quantization step
+        assert torch.allclose(ref_out, tvm_out, atol=0.06)
+
 
 if __name__ == "__main__":
     unittest.main()
@@ -64,14 +64,14 @@ class TVMTest(unittest.TestCase):
 
         return f
 
-    def runBoth(self, func, *inputs, check_tvm=True):
+    def runBoth(self, func, *inputs, check_tvm=True, enable_kwargs=None):
         with torch.no_grad():
             # jit the function
             trace_jit = torch.jit.trace(func, inputs)
             ref_out = trace_jit(*inputs)
 
             # jit the function and lower to TVM
-            torch_tvm.enable()
+            torch_tvm.enable(**(enable_kwargs or {}))
             d = os.path.dirname(os.path.abspath(__file__))
             fn = os.path.join(d, "autotvm_tuning.log")
 
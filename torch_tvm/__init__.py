@@ -3,11 +3,20 @@ from __future__ import division
 from __future__ import print_function
 from __future__ import unicode_literals
 
+import contextlib
+import os
+import re
+
 import torch
+import tvm
+from tvm import autotvm
 from tvm import relay # This registers all the schedules
 
 from ._torch_tvm import *
-from ._torch_tvm import _push_relay_expr
+from ._torch_tvm import _push_relay_expr, _is_tvm_array
+from ._torch_tvm import _start_recording, _stop_recording, _recorded_calls
+from ._torch_tvm import _write_archive
+from ._torch_tvm import _kernel_times, _clear_kernel_times
 from tvm._ffi.function import _init_api # This lets us use PackedFunc with torch_tvm
 _init_api("torch_tvm")
 
@@ -16,3 +25,136 @@ def to_relay(pt_func, inputs):
         pt_func = torch.jit.trace(pt_func, inputs)
     handle = _push_relay_expr(pt_func.graph_for(*inputs), inputs)
     return _pop_relay_expr(handle)
+
+def export(fn, inputs_list, path):
+    """Runs fn on each tuple of example inputs and writes the kernels compiled
+    for them to an archive at path.  Kernels are keyed by the compilation
+    options given to enable(), which must match when the archive is loaded.
+    Kernels compiled by earlier runs are exported as well.  Raises if an
+    input set runs no kernel.  Returns the number of kernels written."""
+    _start_recording()
+    try:
+        for i, inputs in enumerate(inputs_list):
+            recorded = _recorded_calls()
+            fn(*inputs)
+            if _recorded_calls() == recorded:
+                raise RuntimeError(
+                    "torch_tvm.export: no kernel ran for input set {}, its "
+                    "compilation groups fell back to the JIT interpreter or "
+                    "fn has none".format(i))
+        return _write_archive(path)
+    finally:
+        _stop_recording()
+
+def load(path):
+    """Makes the kernels of an archive written by export() available, so
+    matching subgraphs run without being compiled.  Returns the number of
+    kernels loaded."""
+    return load_archive(path)
+
+@contextlib.contextmanager
+def profile(*args, **kwargs):
+    """torch.autograd.profiler.profile, taking the same arguments, with the
+    kernels TVM ran under enable(profile_ops=True) added as events nested in
+    their compilation group.  Events are named after the fused kernel, the
+    kinds of the JIT nodes it runs and their module scopes or source
+    locations, so key_averages() aggregates them per layer."""
+    _clear_kernel_times()
+    with torch.autograd.profiler.profile(*args, **kwargs) as prof:
+        yield prof
+    _add_kernel_events(prof)
+
+_kernel_marker = re.compile(r"^TVM::kernels#(\d+)$")
+
+# Replaces each marker event left by a profiled kernel run with one event per
+# kernel.  Markers are recorded as the last kernel finishes, so the kernels
+# are laid out back to back ending there.
+def _add_kernel_events(prof):
+    from torch.autograd.profiler import EventList, FunctionEvent
+    events = []
+    for evt in prof.function_events:
+        match = _kernel_marker.match(evt.name)
+        if not match:
+            events.append(evt)
+            continue
+        kernels = _kernel_times(int(match.group(1)))
+        start = evt.cpu_interval.start - sum(k["us"] for k in kernels)
+        for k in kernels:
+            name = "TVM::" + k["kernel"]
+            if k["nodes"]:
+                name += " [" + k["nodes"] + "]"
+            if k["source"]:
+                name += " (" + k["source"] + ")"
+            events.append(FunctionEvent(
+                evt.id, name, evt.thread, start, start + k["us"]))
+            start += k["us"]
+    prof.function_events = EventList(events)
+
+# Used by the on-disk compilation cache, exporting a library requires
+# invoking the system compiler which is only exposed through Python
+@tvm.register_func("torch_tvm._export_library")
+def _export_library(mod, path):
+    mod.export_library(path)
+
+_tuning_context = None
+
+# Called by enable(tuning_log=...).  The dispatch context is entered for the
+# lifetime of the process so builds pick up the tuned configs without the
+# caller wrapping them in apply_history_best.
+@tvm.register_func("torch_tvm._apply_tuning_log")
+def _apply_tuning_log(path):
+    global _tuning_context
+    if _tuning_context is not None:
+        _tuning_context.__exit__(None, None, None)
+        _tuning_context = None
+    if path:
+        _tuning_context = autotvm.apply_history_best(path)
+        _tuning_context.__enter__()
+    # Kernels built under another log get different cache keys
+    _set_tuning_log(path)
+
+def tune(log_file, target="llvm -mcpu=core-avx2", n_trial=1000,
+         early_stopping=None):
+    """Tunes the conv2d and dense workloads of the subgraphs built since
+    enable(record_workloads=True) or the previous call on the local CPU,
+    writes the best configs to log_file and applies them to subsequent
+    builds.  target must match the device passed to enable.  Returns the
+    number of tasks tuned."""
+    tasks = []
+    seen = set()
+    for func in _recorded_workloads():
+        for task in autotvm.task.extract_from_program(
+                func, params={}, target=target,
+                ops=(relay.op.nn.conv2d, relay.op.nn.dense)):
+            if task.workload not in seen:
+                seen.add(task.workload)
+                tasks.append(task)
+
+    measure_option = autotvm.measure_option(
+        builder=autotvm.LocalBuilder(),
+        runner=autotvm.LocalRunner(number=10, repeat=1, min_repeat_ms=1000))
+    # log_to_file appends, so the tmp log starts from the configs of
+    # previous calls (pick_best keeps the best of old and new) rather than
+    # leftovers of an interrupted run
+    tmp_log = log_file + ".tmp"
+    with open(tmp_log, "w") as tmp:
+        if tasks and os.path.exists(log_file):
+            with open(log_file) as log:
+                tmp.write(log.read())
+    for i, task in enumerate(tasks):
+        trials = min(n_trial, len(task.config_space))
+        tuner = autotvm.tuner.XGBTuner(task, loss_type="rank")
+        tuner.tune(
+            n_trial=trials,
+            early_stopping=early_stopping,
+            measure_option=measure_option,
+            callbacks=[
+                autotvm.callback.progress_bar(
+                    trials, prefix="[Task {}/{}]".format(i + 1, len(tasks))),
+                autotvm.callback.log_to_file(tmp_log)])
+    if tasks:
+        autotvm.record.pick_best(tmp_log, log_file)
+        _apply_tuning_log(log_file)
+    os.remove(tmp_log)
+    _clear_recorded_workloads()
+    return len(tasks)
@@ -0,0 +1,242 @@
+#include "allocator.h"
+#include "workspace.h"
+
+#include <c10/core/CPUAllocator.h>
+#include <c10/util/Exception.h>
+#include <tvm/runtime/device_api.h>
+#include <tvm/runtime/registry.h>
+
+#include <cstring>
+#include <new>
+
+// Alignment guaranteed by the c10 CPU allocator
+static constexpr size_t kAlignment = 64;
+
+// Rounds nbytes up to one of four classes per power of two, bounding the
+// internal fragmentation to 25%
+static size_t sizeClass(size_t nbytes) {
+  if (nbytes <= kAlignment) {
+    return kAlignment;
+  }
+  size_t pow2 = kAlignment;
+  while (pow2 * 2 <= nbytes) {
+    pow2 *= 2;
+  }
+  size_t step = pow2 / 4;
+  return (nbytes + step - 1) / step * step;
+}
+
+namespace {
+
+// Stored in front of each block, the memory handed out starts kAlignment
+// bytes in
+struct BlockHeader {
+  c10::DataPtr data;
+  size_t size;
+  // The cache of the allocating thread, which the block returns to
+  std::shared_ptr<CPUArena::ThreadCache> owner;
+};
+
+} // namespace
+
+static_assert(sizeof(BlockHeader) <= kAlignment, "block header too large");
+
+static BlockHeader* headerOf(void* ptr) {
+  return reinterpret_cast<BlockHeader*>(static_cast<char*>(ptr) - kAlignment);
+}
+
+CPUArena& CPUArena::get() {
+  static CPUArena arena;
+  return arena;
+}
+
+// Registers the cache of a thread with the arena, returning its blocks when
+// the thread exits
+struct ThreadCacheHolder {
+  std::shared_ptr<CPUArena::ThreadCache> cache =
+      std::make_shared<CPUArena::ThreadCache>();
+
+  ThreadCacheHolder() {
+    auto& arena = CPUArena::get();
+    std::lock_guard<std::mutex> guard(arena.caches_mutex_);
+    arena.caches_.insert(cache.get());
+  }
+  ~ThreadCacheHolder() {
+    auto& arena = CPUArena::get();
+    {
+      std::lock_guard<std::mutex> guard(arena.caches_mutex_);
+      arena.caches_.erase(cache.get());
+    }
+    {
+      // Blocks still in use are released when freed
+      std::lock_guard<std::mutex> guard(cache->mutex);
+      cache->exited = true;
+    }
+    arena.releaseBlocks(*cache);
+  }
+};
+
+const std::shared_ptr<CPUArena::ThreadCache>& CPUArena::threadCache() {
+  thread_local ThreadCacheHolder holder;
+  return holder.cache;
+}
+
+// Returns a block to the c10 allocator
+static void releaseBlock(void* ptr) {
+  auto header = headerOf(ptr);
+  // Moved out first, as the header lives in the memory it frees
+  auto data = std::move(header->data);
+  header->~BlockHeader();
+}
+
+void* CPUArena::allocate(size_t nbytes) {
+  auto size = sizeClass(nbytes);
+  const auto& cache = threadCache();
+  {
+    std::lock_guard<std::mutex> guard(cache->mutex);
+    auto& blocks = cache->free[size];
+    if (!blocks.empty()) {
+      void* ptr = blocks.back();
+      blocks.pop_back();
+      used_bytes_ += size;
+      return ptr;
+    }
+  }
+  auto data = c10::GetCPUAllocator()->allocate(size + kAlignment);
+  auto base = static_cast<char*>(data.get());
+  new (base) BlockHeader{std::move(data), size, cache};
+  allocations_++;
+  reserved_bytes_ += size;
+  used_bytes_ += size;
+  return base + kAlignment;
+}
+
+void CPUArena::free(void* ptr) {
+  auto header = headerOf(ptr);
+  auto size = header->size;
+  used_bytes_ -= size;
+  {
+    auto& cache = *header->owner;
+    std::lock_guard<std::mutex> guard(cache.mutex);
+    if (!cache.exited) {
+      cache.free[size].push_back(ptr);
+      return;
+    }
+  }
+  reserved_bytes_ -= size;
+  releaseBlock(ptr);
+}
+
+void CPUArena::releaseBlocks(ThreadCache& cache) {
+  // Taken out under the lock, as the blocks hold the cache
+  std::unordered_map<size_t, std::vector<void*>> free;
+  {
+    std::lock_guard<std::mutex> guard(cache.mutex);
+    std::swap(free, cache.free);
+  }
+  for (auto& kv : free) {
+    for (void* ptr : kv.second) {
+      releaseBlock(ptr);
+    }
+    reserved_bytes_ -= kv.first * kv.second.size();
+  }
+}
+
+void CPUArena::emptyCache() {
+  std::lock_guard<std::mutex> guard(caches_mutex_);
+  for (auto* cache : caches_) {
+    releaseBlocks(*cache);
+  }
+}
+
+ArenaStats CPUArena::stats() {
+  ArenaStats stats;
+  stats.allocations = allocations_;
+  stats.reserved_bytes = reserved_bytes_;
+  stats.used_bytes = used_bytes_;
+  return stats;
+}
+
+// TVM's own CPU device API.  Kernel workspaces are left to its thread local
+// workspace pool, which TVM's parallel workers use without locking.
+static tvm::runtime::DeviceAPI* lookupTVMCPUDeviceAPI() {
+  auto get_f = tvm::runtime::Registry::Get("device_api.cpu");
+  AT_ASSERT(get_f);
+  void* api = (*get_f)();
+  return static_cast<tvm::runtime::DeviceAPI*>(api);
+}
+
+// Looked up during static initialization, before reg below replaces it
+static tvm::runtime::DeviceAPI* tvm_cpu_api = lookupTVMCPUDeviceAPI();
+
+// Replaces TVM's CPU device API so GraphRuntime storage comes from the arena
+class ArenaCPUDeviceAPI final : public tvm::runtime::DeviceAPI {
+ public:
+  void SetDevice(TVMContext ctx) final {}
+
+  void GetAttr(
+      TVMContext ctx,
+      tvm::runtime::DeviceAttrKind kind,
+      tvm::runtime::TVMRetValue* rv) final {
+    if (kind == tvm::runtime::kExist) {
+      *rv = 1;
+    }
+  }
+
+  void* AllocDataSpace(
+      TVMContext ctx,
+      size_t nbytes,
+      size_t alignment,
+      TVMType type_hint) final {
+    AT_CHECK(
+        alignment <= kAlignment,
+        "Pytorch TVM: unsupported allocation alignment ",
+        alignment);
+    if (void* ptr = placeAllocation(nbytes)) {
+      return ptr;
+    }
+    return CPUArena::get().allocate(nbytes);
+  }
+
+  void FreeDataSpace(TVMContext ctx, void* ptr) final {
+    if (releasePlacedAllocation(ptr)) {
+      return;
+    }
+    CPUArena::get().free(ptr);
+  }
+
+  void CopyDataFromTo(
+      const void* from,
+      size_t from_offset,
+      void* to,
+      size_t to_offset,
+      size_t size,
+      TVMContext ctx_from,
+      TVMContext ctx_to,
+      TVMType type_hint,
+      TVMStreamHandle stream) final {
+    std::memcpy(
+        static_cast<char*>(to) + to_offset,
+        static_cast<const char*>(from) + from_offset,
+        size);
+  }
+
+  void StreamSync(TVMContext ctx, TVMStreamHandle stream) final {}
+
+  void* AllocWorkspace(TVMContext ctx, size_t size, TVMType type_hint) final {
+    return tvm_cpu_api->AllocWorkspace(ctx, size, type_hint);
+  }
+
+  void FreeWorkspace(TVMContext ctx, void* data) final {
+    tvm_cpu_api->FreeWorkspace(ctx, data);
+  }
+};
+
+// TVM looks the device API up on first use, so this must be registered
+// before any CPU array is allocated by TVM
+static auto& reg = tvm::runtime::Registry::Register("device_api.cpu", true)
+                       .set_body([](tvm::runtime::TVMArgs args,
+                                    tvm::runtime::TVMRetValue* rv) {
+                         static ArenaCPUDeviceAPI api;
+                         *rv = static_cast<void*>(&api);
+                       });
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <c10/core/Allocator.h>
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+struct ArenaStats {
+  // Blocks requested from the c10 allocator, which stops growing once the
+  // arena is warm
+  int64_t allocations;
+  // Bytes held by the arena, in use or free
+  int64_t reserved_bytes;
+  int64_t used_bytes;
+};
+
+// Caches CPU memory obtained from the c10 allocator in size classes.  Freed
+// blocks are kept for reuse by later requests of the same class, so a
+// GraphRuntime allocating the same buffers on every call reaches a steady
+// state without calling into the c10 allocator.  Each block starts with a
+// header recording its size class and the thread that allocated it, and
+// freed blocks go back to the free lists of that thread, so concurrent calls
+// do not contend and blocks freed by other threads (e.g. outputs dropped by
+// a consumer thread) are reused by the thread allocating them.
+struct CPUArena {
+  static CPUArena& get();
+
+  void* allocate(size_t nbytes);
+  void free(void* ptr);
+  // Returns the free blocks of all threads to the c10 allocator
+  void emptyCache();
+  ArenaStats stats();
+
+  // Free blocks of a thread, by size class.  The mutex is only contended by
+  // emptyCache and by frees on other threads.  Kept alive by the blocks of
+  // the thread, which are released to the c10 allocator once it has exited.
+  struct ThreadCache {
+    std::mutex mutex;
+    std::unordered_map<size_t, std::vector<void*>> free;
+    bool exited = false;
+  };
+
+ private:
+  const std::shared_ptr<ThreadCache>& threadCache();
+  friend struct ThreadCacheHolder;
+  void releaseBlocks(ThreadCache& cache);
+
+  std::mutex caches_mutex_;
+  std::unordered_set<ThreadCache*> caches_;
+  std::atomic<int64_t> allocations_{0};
+  std::atomic<int64_t> reserved_bytes_{0};
+  std::atomic<int64_t> used_bytes_{0};
+};
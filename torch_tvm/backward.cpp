@@ -0,0 +1,65 @@
+#include "backward.h"
+
+#include <c10/util/Exception.h>
+#include <tvm/relay/attrs/reduce.h>
+#include <tvm/relay/module.h>
+#include <tvm/relay/transform.h>
+
+using namespace tvm::relay;
+
+static Function inferType(Function func) {
+  auto mod = transform::InferType()(ModuleNode::FromExpr(func));
+  return tvm::Downcast<Function>(mod->Lookup("main"));
+}
+
+static Expr sum(Expr expr) {
+  // Reduces over all axes
+  auto attrs = tvm::make_node<ReduceAttrs>();
+  attrs->keepdims = false;
+  attrs->exclude = false;
+  return CallNode::make(Op::Get("sum"), {expr}, tvm::Attrs(attrs), {});
+}
+
+Function makeBackward(Function forward) {
+  auto typed = inferType(forward);
+  const auto* outputs = typed->body.as<TupleNode>();
+  const auto* output_types = typed->body->checked_type().as<TupleTypeNode>();
+  TORCH_CHECK(outputs && output_types, "Pytorch TVM: expected a tuple");
+
+  // The vector-Jacobian product is the gradient of sum(output * grad)
+  tvm::Array<Var> params = typed->params;
+  Expr vjp;
+  for (size_t i = 0; i < outputs->fields.size(); ++i) {
+    auto grad =
+        VarNode::make("grad" + std::to_string(i), output_types->fields[i]);
+    params.push_back(grad);
+    auto term = sum(CallNode::make(
+        Op::Get("multiply"), {outputs->fields[i], grad}, tvm::Attrs(), {}));
+    vjp = vjp.defined()
+        ? CallNode::make(Op::Get("add"), {vjp, term}, tvm::Attrs(), {})
+        : term;
+  }
+
+  // The gradient pass does not accept shared subexpressions
+  auto mod = ModuleNode::FromExpr(
+      FunctionNode::make(params, vjp, Type(), {}));
+  mod = transform::ToANormalForm()(mod);
+  mod = transform::InferType()(mod);
+  auto gradient_f =
+      tvm::runtime::Registry::Get("relay._transform.first_order_gradient");
+  TORCH_CHECK(gradient_f, "Pytorch TVM: the gradient pass is not available");
+  Function gradient = (*gradient_f)(mod->Lookup("main"), mod);
+
+  // gradient returns (sum, (grads of params...)), keep the gradients of the
+  // parameters of forward
+  auto grads = VarNode::make("grads", Type());
+  tvm::Array<Expr> fields;
+  for (size_t i = 0; i < forward->params.size(); ++i) {
+    fields.push_back(TupleGetItemNode::make(grads, i));
+  }
+  auto body = LetNode::make(
+      grads,
+      TupleGetItemNode::make(gradient->body, 1),
+      TupleNode::make(fields));
+  return FunctionNode::make(gradient->params, body, Type(), {});
+}
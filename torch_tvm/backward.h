@@ -0,0 +1,11 @@
+#pragma once
+
+#include <tvm/relay/expr.h>
+
+// Derives the backward of forward, a function returning a tuple of float
+// tensors, with Relay's first order gradient pass.  The result takes the
+// parameters of forward followed by the gradient of each output and returns
+// the tuple of gradients of the parameters of forward.  Activations are
+// recomputed rather than saved by the forward kernel.  Throws if an
+// operator has no registered gradient.
+tvm::relay::Function makeBackward(tvm::relay::Function forward);
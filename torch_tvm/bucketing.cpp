@@ -0,0 +1,126 @@
+#include "bucketing.h"
+
+#include <algorithm>
+#include <string>
+#include <unordered_set>
+
+using namespace torch::jit;
+
+int64_t BucketingPolicy::bucketSize(int64_t dim, int64_t size) const {
+  auto it = buckets.find(dim);
+  if (it == buckets.end()) {
+    return size;
+  }
+  const auto& sizes = it->second;
+  if (sizes.empty()) {
+    int64_t bucket = 1;
+    while (bucket < size) {
+      bucket <<= 1;
+    }
+    return bucket;
+  }
+  auto bucket = std::lower_bound(sizes.begin(), sizes.end(), size);
+  return bucket == sizes.end() ? size : *bucket;
+}
+
+// Rank of the tensor value, -1 if unknown
+static int64_t rankOf(const Value* value) {
+  auto type = value->type()->cast<CompleteTensorType>();
+  return type ? type->sizes().size() : -1;
+}
+
+bool computesIndependently(const Node* node, int64_t dim) {
+  static const std::unordered_set<std::string> elementwise = {
+      "aten::add",
+      "aten::add_",
+      "aten::mul",
+      "aten::relu",
+      "aten::relu_",
+      "aten::threshold_",
+      "aten::quantize_linear",
+      "aten::dequantize",
+      "quantized::add",
+      "quantized::relu",
+  };
+  // Ops over NCHW inputs mixing all dims but the batch
+  static const std::unordered_set<std::string> per_sample = {
+      "aten::_convolution",
+      "aten::batch_norm",
+      "aten::avg_pool2d",
+      "aten::adaptive_avg_pool2d",
+      "aten::max_pool2d",
+      "quantized::conv2d",
+      "quantized::fbgemm_conv2d",
+  };
+  // Ops contracting the last dim of their input
+  static const std::unordered_set<std::string> linear = {
+      "aten::linear",
+      "quantized::linear",
+      "quantized::fbgemm_linear",
+  };
+  auto kind = node->kind();
+  if (kind == prim::Constant || kind == prim::ListConstruct) {
+    return true;
+  }
+  std::string name = kind.toQualString();
+  if (elementwise.count(name)) {
+    return true;
+  }
+  if (per_sample.count(name)) {
+    return dim == 0;
+  }
+  if (linear.count(name)) {
+    return dim < rankOf(node->input(0)) - 1;
+  }
+  return false;
+}
+
+static bool isBucketable(const c10::IValue& input, int64_t dim) {
+  if (!input.isTensor()) {
+    return false;
+  }
+  const auto& tensor = input.toTensor();
+  return tensor.defined() && !tensor.requires_grad() && !tensor.is_quantized() &&
+      tensor.dim() > dim;
+}
+
+bool computeBuckets(
+    const BucketingPolicy& policy,
+    at::ArrayRef<c10::IValue> inputs,
+    BucketedShapes* shapes) {
+  shapes->padded_shapes.assign(inputs.size(), {});
+  shapes->dims.clear();
+  for (const auto& kv : policy.buckets) {
+    auto dim = kv.first;
+    int64_t size = -1;
+    bool consistent = true;
+    for (const auto& input : inputs) {
+      if (!isBucketable(input, dim)) {
+        continue;
+      }
+      auto input_size = input.toTensor().size(dim);
+      consistent &= size == -1 || size == input_size;
+      size = input_size;
+    }
+    if (size == -1 || !consistent) {
+      continue;
+    }
+    auto bucket = policy.bucketSize(dim, size);
+    if (bucket == size) {
+      continue;
+    }
+    shapes->dims.emplace_back(dim, bucket);
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      if (!isBucketable(inputs[i], dim)) {
+        continue;
+      }
+      auto& shape = shapes->padded_shapes[i];
+      if (shape.empty()) {
+        auto sizes = inputs[i].toTensor().sizes();
+        shape.assign(sizes.begin(), sizes.end());
+      }
+      shape[dim] = bucket;
+    }
+  }
+  return !shapes->dims.empty();
+}
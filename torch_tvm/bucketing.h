@@ -0,0 +1,46 @@
+#pragma once
+
+#include <ATen/core/ivalue.h>
+#include <torch/csrc/jit/ir.h>
+
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Rounds input dimensions up to a bucket size so that a handful of compiled
+// kernels serves many input shapes.  Only dimensions along which elements
+// are computed independently (e.g. the batch dimension) may be bucketed.
+struct BucketingPolicy {
+  // Dimension -> increasing bucket sizes.  An empty list rounds up to the
+  // next power of two.
+  std::unordered_map<int64_t, std::vector<int64_t>> buckets;
+
+  bool enabled() const {
+    return !buckets.empty();
+  }
+  // Sizes beyond the largest explicit bucket are left as is
+  int64_t bucketSize(int64_t dim, int64_t size) const;
+};
+
+// Whether node computes the elements of its outputs independently along dim
+// of its inputs, so that padding the inputs along dim leaves the unpadded
+// part of the outputs unchanged.  Ops that reduce or mix along dim (pooling
+// over spatial dims, the contracting dim of linear, reshape) are not, nor
+// is any op not known to be.
+bool computesIndependently(const torch::jit::Node* node, int64_t dim);
+
+struct BucketedShapes {
+  // Shape each input is padded to, empty for inputs passed through as is
+  std::vector<std::vector<int64_t>> padded_shapes;
+  // Bucketed dimensions and the size they are padded to
+  std::vector<std::pair<int64_t, int64_t>> dims;
+};
+
+// Computes the padded shapes of inputs under policy, returning false if no
+// input needs padding.  Inputs that require grad (i.e. parameters) are never
+// padded, and a dimension is only bucketed if all other inputs agree on its
+// size.
+bool computeBuckets(
+    const BucketingPolicy& policy,
+    at::ArrayRef<c10::IValue> inputs,
+    BucketedShapes* shapes);
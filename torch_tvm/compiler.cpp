@@ -1,13 +1,312 @@
 #include "compiler.h"
+#include "backward.h"
+#include "dispatch.h"
+#include "mixed_precision.h"
 #include "operators.h"
 
 #include <ATen/DLConvertor.h>
+#include <ATen/Parallel.h>
+#include <c10/core/thread_pool.h>
+#include <torch/csrc/autograd/function.h>
+#include <torch/csrc/autograd/functions/utils.h>
+#include <torch/csrc/autograd/grad_mode.h>
+#include <torch/csrc/autograd/record_function.h>
+#include <torch/csrc/autograd/saved_variable.h>
+#include <tvm/relay/module.h>
+#include <tvm/relay/transform.h>
 #include <torch/csrc/jit/constants.h>
 #include <torch/csrc/jit/interpreter.h>
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iterator>
 #include <limits>
+#include <mutex>
+#include <sstream>
 
 using namespace torch::jit;
 
+// Background compilation is shared by all TVMCompilers
+static std::mutex compile_pool_mutex;
+static std::unique_ptr<c10::ThreadPool> compile_pool;
+static int compile_threads = 1;
+
+void setCompileThreads(int num_threads) {
+  AT_CHECK(num_threads > 0, "compile_threads must be positive");
+  std::lock_guard<std::mutex> guard(compile_pool_mutex);
+  if (num_threads == compile_threads) {
+    return;
+  }
+  // Let pending builds finish before resizing
+  if (compile_pool) {
+    compile_pool->waitWorkComplete();
+    compile_pool.reset();
+  }
+  compile_threads = num_threads;
+}
+
+static std::atomic<bool> share_aten_threads{false};
+
+void setShareATenThreads(bool share) {
+  share_aten_threads = share;
+}
+
+// Sizes TVM's pool to ATen's intra-op thread count, or to a single thread
+// when called from one of ATen's workers.  TVM's pool is thread local, so
+// every thread launching kernels configures its own.
+static void configureThreadPool() {
+  if (!share_aten_threads.load(std::memory_order_relaxed)) {
+    return;
+  }
+  thread_local int configured_threads = 0;
+  int num_threads = at::in_parallel_region() ? 1 : at::get_num_threads();
+  if (num_threads == configured_threads) {
+    return;
+  }
+  static auto config_f =
+      tvm::runtime::Registry::Get("runtime.config_threadpool");
+  if (!config_f) {
+    static std::once_flag warned;
+    std::call_once(warned, []() {
+      LOG(WARNING) << "Pytorch TVM: runtime.config_threadpool is not "
+                   << "available, TVM keeps its own thread count";
+    });
+  } else {
+    // Affinity mode 0 spreads the workers over all cores
+    (*config_f)(0, num_threads);
+  }
+  configured_threads = num_threads;
+}
+
+static std::atomic<bool> record_workloads{false};
+static std::mutex workloads_mutex;
+static tvm::Array<tvm::relay::Function> workloads;
+// Workloads beyond these are dropped until tune() consumes the recorded ones
+static constexpr size_t kMaxRecordedWorkloads = 1024;
+static bool workloads_dropped = false;
+
+void setRecordWorkloads(bool record) {
+  record_workloads = record;
+}
+
+tvm::Array<tvm::relay::Function> recordedWorkloads() {
+  std::lock_guard<std::mutex> guard(workloads_mutex);
+  return workloads;
+}
+
+void clearRecordedWorkloads() {
+  std::lock_guard<std::mutex> guard(workloads_mutex);
+  workloads = tvm::Array<tvm::relay::Function>();
+  workloads_dropped = false;
+}
+
+static std::atomic<int64_t> conversion_failures{0};
+static std::atomic<int64_t> fallback_calls{0};
+static std::atomic<int64_t> profile_calls{0};
+
+FallbackStats fallbackStats() {
+  FallbackStats stats;
+  stats.conversion_failures = conversion_failures;
+  stats.fallback_calls = fallback_calls;
+  stats.profile_calls = profile_calls;
+  return stats;
+}
+
+TVMObject::~TVMObject() {
+  KernelCacheManager::get().untrack(this);
+}
+
+// Set on the threads of the compile pool, which create runtimes that run on
+// the threads calling the kernels
+static thread_local bool on_compile_thread = false;
+
+static void enqueueCompile(std::function<void()> fn) {
+  std::lock_guard<std::mutex> guard(compile_pool_mutex);
+  if (!compile_pool) {
+    compile_pool.reset(new c10::ThreadPool(compile_threads));
+  }
+  compile_pool->run([fn]() {
+    on_compile_thread = true;
+    fn();
+  });
+}
+
+static ::tvm::Type scalarTypeToTVMType(at::ScalarType type) {
+  switch (type) {
+    case at::kFloat:
+      return ::tvm::Float(32);
+    case at::kDouble:
+      return ::tvm::Float(64);
+    case at::kHalf:
+      return ::tvm::Float(16);
+    case at::kByte:
+      return ::tvm::UInt(8);
+    case at::kChar:
+      return ::tvm::Int(8);
+    case at::kShort:
+      return ::tvm::Int(16);
+    case at::kInt:
+      return ::tvm::Int(32);
+    case at::kLong:
+      return ::tvm::Int(64);
+    case at::kBool:
+      return ::tvm::Bool();
+    // Quantized tensors are bound as their integer representation
+    case at::kQUInt8:
+      return ::tvm::UInt(8);
+    case at::kQInt8:
+      return ::tvm::Int(8);
+    case at::kQInt32:
+      return ::tvm::Int(32);
+    // bfloat16 has no TVM equivalent yet, such subgraphs run in the JIT
+    default:
+      AT_ERROR("Pytorch TVM: unsupported tensor type ", type);
+  }
+}
+
+// ATen describes bool tensors as 8 bit unsigned ints in DLPack while TVM
+// uses 1 bit; the memory layout is the same.
+tvm::runtime::NDArray toTVMArray(const at::Tensor& tensor) {
+  auto dl_tensor = at::toDLPack(tensor);
+  if (tensor.scalar_type() == at::kBool) {
+    dl_tensor->dl_tensor.dtype.bits = 1;
+  }
+  return tvm::runtime::NDArray::FromDLPack(dl_tensor);
+}
+
+namespace {
+
+// Keeps a quantized tensor alive for the DLPack view of its storage
+struct QuantizedDLTensor {
+  at::Tensor tensor;
+  std::vector<int64_t> shape;
+  std::vector<int64_t> strides;
+  DLManagedTensor managed;
+};
+
+} // namespace
+
+static void deleteQuantizedDLTensor(DLManagedTensor* managed) {
+  delete static_cast<QuantizedDLTensor*>(managed->manager_ctx);
+}
+
+// DLPack does not describe quantized types, so the view gets the integer
+// type of the storage
+tvm::runtime::NDArray quantizedTVMArray(const at::Tensor& tensor) {
+  DLDataType dtype;
+  dtype.lanes = 1;
+  switch (tensor.scalar_type()) {
+    case at::kQInt8:
+      dtype.code = kDLInt;
+      dtype.bits = 8;
+      break;
+    case at::kQUInt8:
+      dtype.code = kDLUInt;
+      dtype.bits = 8;
+      break;
+    case at::kQInt32:
+      dtype.code = kDLInt;
+      dtype.bits = 32;
+      break;
+    default:
+      AT_ERROR(
+          "Pytorch TVM: unsupported quantized type ", tensor.scalar_type());
+  }
+  AT_CHECK(
+      tensor.device().is_cpu(),
+      "Pytorch TVM: quantized tensors must be on CPU");
+  auto ctx = new QuantizedDLTensor();
+  ctx->tensor = tensor;
+  ctx->shape = tensor.sizes().vec();
+  ctx->strides = tensor.strides().vec();
+  auto& dl_tensor = ctx->managed.dl_tensor;
+  dl_tensor.data = tensor.data_ptr();
+  dl_tensor.ctx.device_type = kDLCPU;
+  dl_tensor.ctx.device_id = 0;
+  dl_tensor.ndim = tensor.dim();
+  dl_tensor.dtype = dtype;
+  dl_tensor.shape = ctx->shape.data();
+  dl_tensor.strides = ctx->strides.data();
+  dl_tensor.byte_offset = 0;
+  ctx->managed.manager_ctx = ctx;
+  ctx->managed.deleter = &deleteQuantizedDLTensor;
+  return tvm::runtime::NDArray::FromDLPack(&ctx->managed);
+}
+
+at::Tensor fromTVMArray(const tvm::runtime::NDArray& array) {
+  auto dl_tensor = array.ToDLPack();
+  bool is_bool =
+      dl_tensor->dl_tensor.dtype.code == kDLUInt &&
+      dl_tensor->dl_tensor.dtype.bits == 1;
+  if (is_bool) {
+    dl_tensor->dl_tensor.dtype.bits = 8;
+  }
+  auto tensor = at::fromDLPack(dl_tensor);
+  return is_bool ? tensor.to(at::kBool) : tensor;
+}
+
+static void deleteTVMArray(void* ctx) {
+  delete static_cast<tvm::runtime::NDArray*>(ctx);
+}
+
+at::Tensor wrapTVMArray(
+    tvm::runtime::NDArray array,
+    const at::TensorOptions& options) {
+  std::vector<int64_t> sizes(array->shape, array->shape + array->ndim);
+  int64_t numel = 1;
+  for (auto size : sizes) {
+    numel *= size;
+  }
+  void* data = array->data;
+  at::DataPtr data_ptr(
+      data,
+      new tvm::runtime::NDArray(std::move(array)),
+      &deleteTVMArray,
+      options.device());
+  // Resizing replaces the array with memory of the allocator
+  bool cpu = options.device().is_cpu();
+  at::Storage storage(
+      options.dtype(),
+      numel,
+      std::move(data_ptr),
+      cpu ? at::getCPUAllocator() : nullptr,
+      /*resizable=*/cpu);
+  return at::empty({0}, options).set_(storage, 0, sizes, {});
+}
+
+// The array wrapped by tensor if the tensor covers all of it, null otherwise
+static const tvm::runtime::NDArray* wrappedTVMArray(const at::Tensor& tensor) {
+  const auto* array =
+      tensor.storage().data_ptr().cast_context<tvm::runtime::NDArray>(
+          &deleteTVMArray);
+  // Views of the array, e.g. outputs sliced back from a bucket, are
+  // converted as usual
+  if (array && tensor.storage_offset() == 0 && tensor.is_contiguous() &&
+      tensor.sizes() ==
+          at::IntArrayRef((*array)->shape, (*array)->shape + (*array)->ndim)) {
+    return array;
+  }
+  return nullptr;
+}
+
+bool isTVMArray(const at::Tensor& tensor) {
+  return wrappedTVMArray(tensor) != nullptr;
+}
+
+tvm::runtime::NDArray asTVMArray(const at::Tensor& tensor) {
+  if (const auto* array = wrappedTVMArray(tensor)) {
+    return *array;
+  }
+  return toTVMArray(tensor);
+}
+
+static at::ScalarType tvmTypeToScalarType(DLDataType type) {
+  if (type.code == kDLUInt && type.bits == 1) {
+    return at::kBool;
+  }
+  return at::toScalarType(type);
+}
+
 tvm::relay::Var TVMCompiler::convertToRelay(Value* val, TVMContext ctx) {
   auto optional_ivalue = toIValue(val);
   if (optional_ivalue.has_value()) {
@@ -19,8 +318,8 @@ tvm::relay::Var TVMCompiler::convertToRelay(Value* val, TVMContext ctx) {
     for (const auto& size : pt_t->sizes()) {
       sizes.push_back(tvm::relay::IndexExpr(static_cast<int32_t>(size)));
     }
-    // TODO: support non-float tensors
-    auto t = tvm::relay::TensorTypeNode::make(sizes, ::tvm::Float(32));
+    auto t = tvm::relay::TensorTypeNode::make(
+        sizes, scalarTypeToTVMType(pt_t->scalarType()));
     auto v = tvm::relay::VarNode::make(
         val->debugName() +
             std::to_string(reinterpret_cast<std::uintptr_t>(val)),
@@ -33,6 +332,13 @@ tvm::relay::Var TVMCompiler::convertToRelay(Value* val, TVMContext ctx) {
 tvm::relay::Expr TVMCompiler::convertToRelay(
     const IValue& val,
     TVMContext ctx) {
+  // Constant tensors (e.g. weights) are bound into the function rather than
+  // passed on every call, letting Relay fold and pre-transform them at build
+  // time.  They end up in the params of the built artifact.
+  if (val.isTensor()) {
+    auto x = toTVMArray(val.toTensor().contiguous());
+    return tvm::relay::ConstantNode::make(x);
+  }
   // All doubles are converted to floats
   if (val.isDouble()) {
     auto x = tvm::runtime::NDArray::Empty(
@@ -89,88 +395,136 @@ tvm::relay::Expr TVMCompiler::convertToRelay(
       0, "Cannot convert value ", val, " to Relay yet.  Please file a bug.\n");
 }
 
+// Types of the fields of the tuple returned by a function with params and
+// body output
+static tvm::Array<tvm::relay::Type> inferOutputTypes(
+    const tvm::Array<tvm::relay::Var>& params,
+    const tvm::relay::Expr& output) {
+  auto mod = tvm::relay::ModuleNode::FromExpr(tvm::relay::FunctionNode::make(
+      params, output, tvm::relay::Type(), {}));
+  mod = tvm::relay::transform::InferType()(mod);
+  auto func = tvm::Downcast<tvm::relay::Function>(mod->Lookup("main"));
+  auto tuple_type = func->body->checked_type().as<tvm::relay::TupleTypeNode>();
+  AT_ASSERT(tuple_type);
+  return tuple_type->fields;
+}
+
 tvm::relay::Function TVMCompiler::convertToRelay(
     std::shared_ptr<Graph> subgraph,
     TVMContext ctx,
-    std::vector<Value*>* input_values) {
+    std::vector<Value*>* input_values,
+    const BlockedLayout* layout,
+    std::vector<NodeOps>* node_ops) {
   std::unordered_map<Value*, tvm::relay::Expr> value_map;
   tvm::Array<tvm::relay::Var> input_vars;
 
-  for (const auto& input : subgraph->inputs()) {
+  for (size_t i = 0; i < subgraph->inputs().size(); ++i) {
+    auto input = subgraph->inputs()[i];
     AT_ASSERT(input->isCompleteTensor());
     auto v = convertToRelay(input, ctx);
-    input_vars.push_back(v);
     if (input_values) {
       input_values->emplace_back(input);
     }
     value_map[input] = v;
+    if (layout && layout->inputs[i]) {
+      // The input type holds the NCHW shape, the kernel receives it blocked
+      auto sizes = input->type()->cast<CompleteTensorType>()->sizes();
+      tvm::Array<tvm::relay::IndexExpr> blocked_sizes;
+      for (auto size : {sizes[0],
+                        sizes[1] / layout->block,
+                        sizes[2],
+                        sizes[3],
+                        layout->block}) {
+        blocked_sizes.push_back(
+            tvm::relay::IndexExpr(static_cast<int32_t>(size)));
+      }
+      auto t = v->type_annotation.as<tvm::relay::TensorTypeNode>();
+      v = tvm::relay::VarNode::make(
+          v->name_hint(),
+          tvm::relay::TensorTypeNode::make(blocked_sizes, t->dtype));
+      value_map[input] = layoutTransform(
+          v, blockedLayoutName(layout->block), "NCHW");
+    }
+    input_vars.push_back(v);
   }
 
-  auto frontier = subgraph->inputs().vec();
-  // TODO error handle incorrectly formed graphs (not dominated by frontier)
-  while (frontier.size()) {
-    std::vector<Value*> new_frontier = {};
-    for (const auto& value : frontier) {
-      auto uses = value->uses();
-      for (const auto& use : uses) {
-        tvm::Array<tvm::relay::Expr> relay_inputs;
-        auto skip_user = false;
-        for (const auto& input : use.user->inputs()) {
-          if (value_map.find(input) == value_map.end()) {
-            // We may be dealing with a constant, handle that here
-            auto optional_ivalue = toIValue(input);
-            if (!optional_ivalue.has_value()) {
-              skip_user = true;
-              break;
-            } else {
-              if (optional_ivalue.value().isTensor()) {
-                if (input_values) {
-                  input_values->emplace_back(input);
-                }
-                auto input_var = convertToRelay(input, ctx);
-                input_vars.push_back(input_var);
-                value_map[input] = input_var;
-              } else {
-                value_map[input] = convertToRelay(optional_ivalue.value(), ctx);
-              }
-            }
-          }
-          relay_inputs.push_back(value_map[input]);
-        }
-        if (skip_user) {
-          continue;
-        }
-        // Things like prim::Return
-        if (use.user->outputs().size() < 1) {
-          continue;
-        }
-        // if there are 2+ outputs, getOperator returns a tuple
-        if (use.user->outputs().size() == 1) {
-          value_map[use.user->output()] = getOperator(use.user, relay_inputs);
-          new_frontier.emplace_back(use.user->output());
-        } else {
-          auto tuple = getOperator(use.user, relay_inputs);
-          int index = 0;
-          for (const auto& output : use.user->outputs()) {
-            auto n = tvm::make_node<tvm::relay::TupleGetItemNode>();
-            n->tuple = tuple;
-            n->index = index;
-            value_map[output] = tvm::relay::TupleGetItem(n);
-            index++;
-            new_frontier.emplace_back(output);
-          }
-        }
+  // Looks up the expression of value, converting constants on first use
+  auto lookup = [&](Value* value) -> const tvm::relay::Expr& {
+    auto it = value_map.find(value);
+    if (it != value_map.end()) {
+      return it->second;
+    }
+    auto optional_ivalue = toIValue(value);
+    AT_CHECK(
+        optional_ivalue.has_value(),
+        "Pytorch TVM: value %",
+        value->debugName(),
+        " is neither computed by the subgraph nor a constant");
+    return value_map
+        .emplace(value, convertToRelay(optional_ivalue.value(), ctx))
+        .first->second;
+  };
+
+  // Nodes of a JIT graph are topologically sorted, so a single pass sees
+  // every input before its users.  The argument buffer is reused across
+  // nodes and copied into an exactly sized Array.
+  std::vector<tvm::relay::Expr> args;
+  for (const auto& node : subgraph->nodes()) {
+    // Constants are converted when used, as some are only consumed as
+    // attributes by the operator converters
+    if (node->kind() == prim::Constant || node->outputs().size() < 1) {
+      continue;
+    }
+    args.clear();
+    for (const auto& input : node->inputs()) {
+      args.emplace_back(lookup(input));
+    }
+    tvm::Array<tvm::relay::Expr> node_args(args.begin(), args.end());
+    auto op = getOperator(node, node_args);
+    if (node_ops) {
+      node_ops->push_back(nodeOpsOf(node, op, node_args));
+    }
+    // if there are 2+ outputs, getOperator returns a tuple
+    if (node->outputs().size() == 1) {
+      value_map[node->output()] = op;
+    } else {
+      int index = 0;
+      for (const auto& output : node->outputs()) {
+        auto n = tvm::make_node<tvm::relay::TupleGetItemNode>();
+        n->tuple = op;
+        n->index = index;
+        value_map[output] = tvm::relay::TupleGetItem(n);
+        index++;
       }
     }
-    frontier = new_frontier;
   }
 
   tvm::NodePtr<tvm::relay::TupleNode> n =
       tvm::make_node<tvm::relay::TupleNode>();
   tvm::Array<tvm::relay::Expr> fields;
   for (const auto& sg_output : subgraph->outputs()) {
-    AT_ASSERT(value_map.find(sg_output) != value_map.end());
-    fields.push_back(value_map[sg_output]);
+    fields.push_back(lookup(sg_output));
+  }
+  // Emit the marked outputs blocked, if their channels divide evenly.
+  // Consumers tell blocked inputs by their rank.
+  if (layout &&
+      std::find(layout->outputs.begin(), layout->outputs.end(), true) !=
+          layout->outputs.end()) {
+    auto types =
+        inferOutputTypes(input_vars, tvm::relay::TupleNode::make(fields));
+    for (size_t i = 0; i < fields.size(); ++i) {
+      auto t = types[i].as<tvm::relay::TensorTypeNode>();
+      if (!layout->outputs[i] || !t || t->shape.size() != 4) {
+        continue;
+      }
+      auto channels = t->shape[1].as<tvm::IntImm>();
+      if (channels && channels->value % layout->block == 0) {
+        fields.Set(
+            i,
+            layoutTransform(
+                fields[i], "NCHW", blockedLayoutName(layout->block)));
+      }
+    }
   }
   n->fields = std::move(fields);
   auto output = tvm::relay::Tuple(n);
@@ -194,12 +548,27 @@ TVMCompiler::TVMCompiler(
     bool strict,
     std::string device_type,
     std::string device,
-    std::string host)
+    std::string host,
+    std::string cache_dir,
+    bool async_compile,
+    BucketingPolicy bucketing,
+    int hot_threshold,
+    int tier0_opt_level,
+    int profile_runs,
+    std::string precision)
     : opt_level_(opt_level),
       strict_(strict),
       device_type_(device_type),
       device_(device),
-      host_(host) {
+      host_(host),
+      cache_dir_(cache_dir),
+      async_compile_(async_compile),
+      bucketing_(std::move(bucketing)),
+      hot_threshold_(hot_threshold),
+      tier0_opt_level_(tier0_opt_level),
+      profile_runs_(profile_runs),
+      precision_(std::move(precision)) {
+  cache_ = std::make_shared<const TVMCache>();
   if (device_type_ == "gpu") {
     ctx_.device_type = kDLGPU;
   } else {
@@ -207,90 +576,1091 @@ TVMCompiler::TVMCompiler(
   }
   ctx_.device_id = 0;
   subgraph_ = node->g(attr::Subgraph);
+  layout_ = blockedLayoutOf(node);
+  inplace_ = inPlaceOutputsOf(node);
+  static std::atomic<int64_t> next_group_id{0};
+  group_id_ = next_group_id++;
+  for (const auto* n : subgraph_->nodes()) {
+    if (n->kind() == prim::Constant) {
+      continue;
+    }
+    if (!group_ops_.empty()) {
+      group_ops_ += ", ";
+    }
+    group_ops_ += n->kind().toQualString();
+  }
+  // Padded rows would leak into the results of nodes reducing or mixing
+  // along a bucketed dimension, which is therefore not bucketed
+  for (auto it = bucketing_.buckets.begin(); it != bucketing_.buckets.end();) {
+    bool independent = true;
+    for (const auto* n : subgraph_->nodes()) {
+      independent &= computesIndependently(n, it->first);
+    }
+    it = independent ? std::next(it) : bucketing_.buckets.erase(it);
+  }
+}
+
+// Serializes the params produced by a Relay build into the format consumed
+// by the GraphRuntime's load_params
+static std::string serializeParams(
+    const tvm::Map<std::string, tvm::relay::Constant>& params) {
+  auto save_f = tvm::runtime::Registry::Get("tvm.relay._save_param_dict");
+  AT_ASSERT(save_f);
+  std::vector<std::string> names;
+  std::vector<tvm::runtime::NDArray> arrays;
+  for (const auto& kv : params) {
+    names.emplace_back(kv.first);
+    arrays.emplace_back(kv.second->data);
+  }
+  int num_args = names.size() * 2;
+  std::vector<TVMValue> values(num_args);
+  std::vector<int> type_codes(num_args);
+  tvm::runtime::TVMArgsSetter setter(values.data(), type_codes.data());
+  for (size_t i = 0; i < names.size(); ++i) {
+    setter(2 * i, names[i]);
+    setter(2 * i + 1, arrays[i]);
+  }
+  tvm::runtime::TVMRetValue rv;
+  save_f->CallPacked(
+      tvm::runtime::TVMArgs(values.data(), type_codes.data(), num_args), &rv);
+  std::string blob = rv;
+  return blob;
+}
+
+// Enters a relay PassContext at opt_level for the lifetime of the guard
+struct PassContextGuard {
+  explicit PassContextGuard(int opt_level) {
+    auto make_f = tvm::runtime::Registry::Get("relay._transform.PassContext");
+    auto enter_f =
+        tvm::runtime::Registry::Get("relay._transform.EnterPassContext");
+    exit_f_ = tvm::runtime::Registry::Get("relay._transform.ExitPassContext");
+    if (!make_f || !enter_f || !exit_f_) {
+      exit_f_ = nullptr;
+      return;
+    }
+    pass_ctx_ = (*make_f)(
+        opt_level,
+        /*fallback_device=*/static_cast<int>(kDLCPU),
+        tvm::Array<tvm::Expr>(),
+        tvm::Array<tvm::Expr>());
+    (*enter_f)(pass_ctx_);
+  }
+  ~PassContextGuard() {
+    if (exit_f_) {
+      (*exit_f_)(pass_ctx_);
+    }
+  }
+
+ private:
+  const tvm::runtime::PackedFunc* exit_f_;
+  tvm::runtime::TVMRetValue pass_ctx_;
+};
+
+TVMArtifact TVMCompiler::build(tvm::relay::Function func, int opt_level) {
+  if (record_workloads) {
+    std::lock_guard<std::mutex> guard(workloads_mutex);
+    if (workloads.size() < kMaxRecordedWorkloads) {
+      workloads.push_back(func);
+    } else if (!workloads_dropped) {
+      LOG(WARNING) << "Pytorch TVM: recorded " << kMaxRecordedWorkloads
+                   << " workloads, dropping further ones until tune()\n";
+      workloads_dropped = true;
+    }
+  }
+  // BuildModules are not thread safe, so each build gets its own
   auto pfb = tvm::runtime::Registry::Get("relay.build_module._BuildModule");
   AT_ASSERT(pfb);
-  build_mod_ = (*pfb)();
+  tvm::runtime::Module build_mod = (*pfb)();
+  auto build_f = build_mod.GetFunction("build", false);
+  auto json_f = build_mod.GetFunction("get_graph_json", false);
+  auto mod_f = build_mod.GetFunction("get_module", false);
+  auto params_f = build_mod.GetFunction("get_params", false);
+  // Older BuildModules take the opt level directly, newer ones read it from
+  // the current PassContext
+  auto set_opt_level_f = build_mod.GetFunction("set_opt_level", false);
+  std::unique_ptr<PassContextGuard> pass_ctx;
+  if (set_opt_level_f != nullptr) {
+    set_opt_level_f(opt_level);
+  } else {
+    pass_ctx.reset(new PassContextGuard(opt_level));
+  }
+  tvm::Map<tvm::Integer, tvm::Target> target_map = {
+      {ctx_.device_type, tvm::Target::Create(device_)}};
+  build_f(func, target_map, tvm::Target::Create(host_));
+  std::string json = json_f();
+  TVMArtifact artifact;
+  artifact.graph_json = json;
+  artifact.lib = mod_f();
+  tvm::Map<std::string, tvm::relay::Constant> params = params_f();
+  artifact.params = serializeParams(params);
+  return artifact;
+}
+
+std::unique_ptr<TVMRuntime> TVMCompiler::acquireRuntime(
+    TVMObject& obj,
+    bool* created) {
+  if (created) {
+    *created = false;
+  }
+  std::unique_ptr<TVMRuntime> runtime;
+  std::unique_ptr<tvm::runtime::Module> params_owner;
+  std::vector<std::unique_ptr<TVMRuntime>> orphans;
+  int64_t reclaimed_bytes = 0;
+  {
+    // Runtimes placed in a workspace only run on the slab's thread.  Those
+    // of exited threads are reclaimed.
+    std::lock_guard<std::mutex> guard(obj.runtimes_mutex);
+    for (auto it = obj.runtimes.begin(); it != obj.runtimes.end();) {
+      if ((*it)->slab && (*it)->slab->orphaned) {
+        reclaimed_bytes += (*it)->bytes;
+        orphans.push_back(std::move(*it));
+        it = obj.runtimes.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    if (obj.params_owner_slab && obj.params_owner_slab->orphaned) {
+      // Any other runtime holds the params as well
+      obj.params_owner.reset();
+      obj.params_owner_slab.reset();
+      if (!obj.runtimes.empty()) {
+        obj.params_owner.reset(
+            new tvm::runtime::Module(obj.runtimes.front()->mod));
+        obj.params_owner_slab = obj.runtimes.front()->slab;
+      } else {
+        reclaimed_bytes += obj.artifact.params.size();
+      }
+    }
+    auto thread = std::this_thread::get_id();
+    for (auto it = obj.runtimes.rbegin(); it != obj.runtimes.rend(); ++it) {
+      if (!(*it)->slab || (*it)->slab->owner == thread) {
+        runtime = std::move(*it);
+        obj.runtimes.erase(std::next(it).base());
+        break;
+      }
+    }
+    if (!runtime && obj.params_owner) {
+      params_owner.reset(new tvm::runtime::Module(*obj.params_owner));
+    }
+  }
+  // Frees the slabs whose last runtimes were orphans
+  orphans.clear();
+  if (reclaimed_bytes > 0) {
+    KernelCacheManager::get().addBytes(&obj, -reclaimed_bytes);
+  }
+  if (runtime) {
+    return runtime;
+  }
+
+  // All runtimes are busy, create another one sharing the compiled module
+  const tvm::runtime::PackedFunc* pfr = nullptr;
+  if (profileOps()) {
+    pfr = tvm::runtime::Registry::Get("tvm.graph_runtime_debug.create");
+    if (!pfr) {
+      LOG(WARNING) << "Pytorch TVM: TVM was built without the debug graph "
+                   << "runtime, kernels are not profiled\n";
+    }
+  }
+  if (!pfr) {
+    pfr = tvm::runtime::Registry::Get("tvm.graph_runtime.create");
+  }
+  AT_ASSERT(pfr);
+  runtime.reset(new TVMRuntime());
+  {
+    // A runtime created on a compile thread is first used by another thread
+    std::unique_ptr<WorkspacePlacementGuard> placement;
+    if (obj.workspace.enabled() && !on_compile_thread) {
+      runtime->slab = threadWorkspace(obj.workspace.slab_bytes);
+      placement.reset(
+          new WorkspacePlacementGuard(obj.workspace, *runtime->slab));
+    }
+    runtime->mod = (*pfr)(
+        obj.artifact.graph_json,
+        obj.artifact.lib,
+        (int)ctx_.device_type,
+        (int)ctx_.device_id);
+  }
+  TVMByteArray params_arr;
+  params_arr.data = obj.artifact.params.data();
+  params_arr.size = obj.artifact.params.size();
+  // Runtimes of a spec reference a single copy of the params
+  auto share_params = runtime->mod.GetFunction("share_params", true);
+  runtime->bytes =
+      runtime->slab ? obj.workspace.private_bytes : obj.storage_bytes;
+  int64_t bytes = runtime->bytes;
+  if (params_owner && share_params != nullptr) {
+    share_params(*params_owner, params_arr);
+  } else {
+    runtime->mod.GetFunction("load_params", false)(params_arr);
+    bytes += obj.artifact.params.size();
+    std::lock_guard<std::mutex> guard(obj.runtimes_mutex);
+    if (!obj.params_owner) {
+      obj.params_owner.reset(new tvm::runtime::Module(runtime->mod));
+      obj.params_owner_slab = runtime->slab;
+    }
+  }
+  KernelCacheManager::get().addBytes(&obj, bytes);
+  if (created) {
+    *created = true;
+  }
+  runtime->set_input = runtime->mod.GetFunction("set_input_zero_copy", false);
+  runtime->kernel = runtime->mod.GetFunction("run", false);
+  runtime->get_output = runtime->mod.GetFunction("get_output", false);
+  runtime->set_output = runtime->mod.GetFunction("set_output_zero_copy", true);
+  if (!obj.kernels.empty()) {
+    runtime->run_individual = runtime->mod.GetFunction("run_individual", true);
+  }
+  auto get_num_outputs = runtime->mod.GetFunction("get_num_outputs", false);
+  int n = get_num_outputs();
+  AT_CHECK(
+      obj.num_outputs == n, "Compiled subgraph with mismatching num outputs");
+  return runtime;
+}
+
+void TVMCompiler::releaseRuntime(
+    TVMObject& obj,
+    std::unique_ptr<TVMRuntime> runtime) {
+  std::lock_guard<std::mutex> guard(obj.runtimes_mutex);
+  obj.runtimes.emplace_back(std::move(runtime));
+}
+
+// Must be called with cache_mutex_ held
+void TVMCompiler::publish(
+    const CompleteArgumentSpec& spec,
+    std::shared_ptr<TVMCacheEntry> entry) {
+  auto next = std::make_shared<TVMCache>(*std::atomic_load(&cache_));
+  (*next)[spec] = std::move(entry);
+  std::atomic_store(&cache_, std::shared_ptr<const TVMCache>(next));
+}
+
+std::shared_ptr<TVMObject> TVMCompiler::compile(
+    tvm::relay::Function func,
+    BucketedShapes buckets,
+    std::string key,
+    int opt_level) {
+  auto artifact = build(func, opt_level);
+  if (!key.empty()) {
+    if (!cache_dir_.empty()) {
+      saveToDiskCache(cache_dir_, key, artifact);
+    }
+    recordArtifact(key, artifact);
+  }
+  return instantiate(
+      std::move(artifact), std::move(buckets), subgraph_->outputs().size());
+}
+
+std::shared_ptr<TVMObject> TVMCompiler::instantiate(
+    TVMArtifact artifact,
+    BucketedShapes buckets,
+    size_t num_outputs,
+    bool forward) {
+  auto obj = std::make_shared<TVMObject>();
+  obj->artifact = std::move(artifact);
+  obj->input_values = subgraph_->inputs().vec();
+  obj->num_outputs = num_outputs;
+  obj->buckets = std::move(buckets);
+  obj->storage_bytes = graphStorageBytes(obj->artifact.graph_json);
+  if (sharedWorkspace() && ctx_.device_type == kDLCPU) {
+    obj->workspace = planWorkspace(obj->artifact.graph_json);
+  }
+  if (profileOps()) {
+    // Kernels loaded from the disk cache or an archive before any
+    // conversion are reported without their nodes
+    auto node_ops = std::atomic_load(&node_ops_);
+    obj->kernels = attributeKernels(
+        obj->artifact.graph_json,
+        forward && node_ops ? *node_ops : std::vector<NodeOps>());
+  }
+  // Instantiate a first runtime eagerly, validating the build
+  auto runtime = acquireRuntime(*obj);
+  for (size_t i = 0; i < num_outputs; ++i) {
+    tvm::runtime::NDArray output = runtime->get_output(i);
+    obj->output_shapes.emplace_back(
+        output->shape, output->shape + output->ndim);
+    auto device = ctx_.device_type == kDLGPU ? at::kCUDA : at::kCPU;
+    obj->output_options.emplace_back(
+        at::TensorOptions(device).dtype(tvmTypeToScalarType(output->dtype)));
+    obj->output_dtypes.push_back(output->dtype);
+  }
+  releaseRuntime(*obj, std::move(runtime));
+  return obj;
+}
+
+void TVMCompiler::runFallback(Stack& stack) {
+  fallback_calls++;
+  runInterpreter(stack);
+}
+
+void TVMCompiler::runInterpreter(Stack& stack) {
+  if (layout_.enabled()) {
+    // The interpreter expects NCHW where another group produced blocked
+    // activations
+    auto num_inputs = subgraph_->inputs().size();
+    for (size_t i = 0; i < num_inputs; ++i) {
+      auto& input = stack[stack.size() - num_inputs + i];
+      if (layout_.inputs[i] && input.toTensor().dim() == 5) {
+        input = IValue(unblock(input.toTensor()));
+      }
+    }
+  }
+  {
+    std::lock_guard<std::mutex> guard(fallback_mutex_);
+    if (!fallback_code_) {
+      fallback_code_ = Code(subgraph_);
+    }
+  }
+  InterpreterState(fallback_code_).run(stack);
+}
+
+// Bytes held by an object fresh out of compile, which has a single runtime
+static int64_t initialBytes(const TVMObject& obj) {
+  int64_t bytes = obj.artifact.params.size();
+  for (const auto& runtime : obj.runtimes) {
+    bytes += runtime->bytes;
+  }
+  return bytes;
+}
+
+void TVMCompiler::evict(const std::shared_ptr<TVMCacheEntry>& entry) {
+  std::lock_guard<std::mutex> guard(cache_mutex_);
+  auto next = std::make_shared<TVMCache>();
+  for (const auto& kv : *std::atomic_load(&cache_)) {
+    if (kv.second != entry) {
+      next->emplace(kv.first, kv.second);
+    }
+  }
+  std::atomic_store(&cache_, std::shared_ptr<const TVMCache>(next));
+}
+
+void TVMCompiler::installKernel(
+    const std::shared_ptr<TVMCacheEntry>& entry,
+    std::shared_ptr<TVMObject> obj,
+    int tier) {
+  KernelCacheManager::get().track(
+      shared_from_this(), entry, obj.get(), initialBytes(*obj));
+  entry->tier = tier;
+  std::atomic_store(&entry->obj, std::move(obj));
+}
+
+void TVMCompiler::compileAsync(
+    std::shared_ptr<TVMCacheEntry> entry,
+    tvm::relay::Function func,
+    BucketedShapes buckets,
+    std::string key,
+    int opt_level,
+    int tier) {
+  auto self = shared_from_this();
+  enqueueCompile([self, entry, func, buckets, key, opt_level, tier]() {
+    std::shared_ptr<TVMObject> obj;
+    try {
+      obj = self->compile(func, buckets, key, opt_level);
+    } catch (const std::exception& e) {
+      LOG(WARNING)
+          << "Pytorch TVM: background compilation failed, falling back to JIT for execution, exception: "
+          << e.what() << "\n";
+      return;
+    }
+    // Calls still running the previous kernel keep it alive until they
+    // return
+    self->installKernel(entry, std::move(obj), tier);
+    KernelCacheManager::get().enforceBudget();
+  });
+}
+
+std::vector<SpecStats> TVMCompiler::specStats() {
+  std::vector<SpecStats> stats;
+  for (const auto& kv : *std::atomic_load(&cache_)) {
+    SpecStats spec_stats;
+    spec_stats.group_id = group_id_;
+    spec_stats.group_ops = group_ops_;
+    for (size_t i = 0; i < kv.first.size(); ++i) {
+      auto sizes = kv.first.at(i).sizes();
+      spec_stats.shapes.emplace_back(sizes.begin(), sizes.end());
+    }
+    spec_stats.tier = kv.second->tier;
+    spec_stats.calls = kv.second->calls;
+    stats.emplace_back(std::move(spec_stats));
+  }
+  return stats;
+}
+
+static std::mutex compilers_mutex;
+static std::vector<std::weak_ptr<TVMCompiler>> compilers;
+
+void registerCompiler(const std::shared_ptr<TVMCompiler>& compiler) {
+  std::lock_guard<std::mutex> guard(compilers_mutex);
+  compilers.erase(
+      std::remove_if(
+          compilers.begin(),
+          compilers.end(),
+          [](const std::weak_ptr<TVMCompiler>& c) { return c.expired(); }),
+      compilers.end());
+  compilers.emplace_back(compiler);
+}
+
+std::vector<SpecStats> allSpecStats() {
+  std::vector<std::shared_ptr<TVMCompiler>> live;
+  {
+    std::lock_guard<std::mutex> guard(compilers_mutex);
+    for (const auto& c : compilers) {
+      if (auto compiler = c.lock()) {
+        live.emplace_back(std::move(compiler));
+      }
+    }
+  }
+  std::vector<SpecStats> stats;
+  for (const auto& compiler : live) {
+    auto compiler_stats = compiler->specStats();
+    stats.insert(stats.end(), compiler_stats.begin(), compiler_stats.end());
+  }
+  return stats;
+}
+
+// Looks up or creates the cache entry for spec.  Must be called with
+// cache_mutex_ held.
+std::shared_ptr<TVMCacheEntry> TVMCompiler::createEntry(
+    const CompleteArgumentSpec& spec,
+    at::ArrayRef<IValue> inputs) {
+  // Kernels are compiled for the padded inputs if bucketing applies
+  BucketedShapes buckets;
+  std::vector<IValue> compile_inputs(inputs.begin(), inputs.end());
+  std::unique_ptr<CompleteArgumentSpec> bucket_spec;
+  if (bucketing_.enabled() && computeBuckets(bucketing_, inputs, &buckets)) {
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      const auto& shape = buckets.padded_shapes[i];
+      if (!shape.empty()) {
+        compile_inputs[i] = IValue(torch::autograd::make_variable(
+            at::empty(shape, inputs[i].toTensor().options())));
+      }
+    }
+    bucket_spec.reset(new CompleteArgumentSpec(
+        false, ArrayRef<IValue>(compile_inputs)));
+    auto cache = std::atomic_load(&cache_);
+    auto it = cache->find(*bucket_spec);
+    if (it != cache->end()) {
+      publish(spec, it->second);
+      return it->second;
+    }
+  }
+
+  for (size_t i = 0; i < compile_inputs.size(); ++i) {
+    subgraph_->inputs()[i]->inferTypeFrom(compile_inputs[i].toTensor());
+  }
+  // Inputs produced blocked by another group are typed with their NCHW
+  // shape, the kernel converts them on entry
+  BlockedLayout layout = layout_;
+  if (layout.enabled()) {
+    for (size_t i = 0; i < compile_inputs.size(); ++i) {
+      const auto& tensor = compile_inputs[i].toTensor();
+      layout.inputs[i] = layout.inputs[i] && tensor.dim() == 5;
+      if (layout.inputs[i]) {
+        subgraph_->inputs()[i]->setType(CompleteTensorType::create(
+            tensor.scalar_type(),
+            tensor.device(),
+            unblockedShape(tensor.sizes())));
+      }
+    }
+  }
+  // Quantized values are exchanged as integers, their parameters are folded
+  // into the kernel
+  auto qparams = inferQParams(*subgraph_, inputs);
+  std::vector<QParams> input_qparams;
+  std::vector<QParams> output_qparams;
+  if (!qparams.empty()) {
+    input_qparams = qparamsOf(inputs);
+    for (const auto* output : subgraph_->outputs()) {
+      auto it = qparams.find(output);
+      output_qparams.emplace_back(
+          it != qparams.end() ? it->second : QParams());
+    }
+  }
+  // The key depends on the types inferred above.  It is computed for every
+  // spec, as kernels compiled before torch_tvm.export started recording are
+  // exported under it.
+  auto key = diskCacheKey(
+      *subgraph_,
+      bucket_spec ? *bucket_spec : spec,
+      opt_level_,
+      device_,
+      host_);
+  if (layout.enabled()) {
+    std::ostringstream layout_key;
+    layout_key << "layout: " << blockedLayoutName(layout.block) << " in";
+    for (bool blocked : layout.inputs) {
+      layout_key << " " << blocked;
+    }
+    layout_key << " out";
+    for (bool blocked : layout.outputs) {
+      layout_key << " " << blocked;
+    }
+    key += layout_key.str() + "\n";
+  }
+  if (precision_ != "fp32") {
+    key += "precision: " + precision_ + "\n";
+  }
+  if (!input_qparams.empty()) {
+    std::ostringstream qparams_key;
+    qparams_key << "qparams:"
+                << std::setprecision(std::numeric_limits<double>::digits10 + 2);
+    for (const auto& input : input_qparams) {
+      qparams_key << " " << input.scale << "/" << input.zero_point;
+    }
+    key += qparams_key.str() + "\n";
+  }
+
+  // Specs profiled by an earlier run skip the measurements, and are not even
+  // built if the interpreter is faster
+  DispatchDecision decision;
+  int dispatch = kDispatchUndecided;
+  if (profile_runs_ > 0 && DispatchTable::get().lookup(key, &decision)) {
+    dispatch = decision.use_tvm ? kDispatchTVM : kDispatchJIT;
+  }
+  if (dispatch == kDispatchJIT) {
+    auto entry = std::make_shared<TVMCacheEntry>();
+    entry->dispatch = dispatch;
+    entry->key = key;
+    publish(spec, entry);
+    if (bucket_spec) {
+      publish(*bucket_spec, entry);
+    }
+    return entry;
+  }
+
+  // Kernels compiled ahead of time or by another process are used as is,
+  // without converting the subgraph to Relay
+  TVMArtifact artifact;
+  if (!key.empty() &&
+      (findPreloadedArtifact(key, &artifact) ||
+       (!cache_dir_.empty() &&
+        loadFromDiskCache(cache_dir_, key, &artifact)))) {
+    recordArtifact(key, artifact);
+    auto entry = std::make_shared<TVMCacheEntry>();
+    entry->dispatch = dispatch;
+    entry->key = key;
+    entry->input_qparams = input_qparams;
+    entry->output_qparams = output_qparams;
+    installKernel(
+        entry,
+        instantiate(
+            std::move(artifact), buckets, subgraph_->outputs().size()),
+        kTierOptimized);
+    publish(spec, entry);
+    if (bucket_spec) {
+      publish(*bucket_spec, entry);
+    }
+    return entry;
+  }
+
+  // bail out mechanism: try to convert to Relay, if it fails to convert the
+  // graph by any reason(i.e. op difference), depend on the user preference,
+  // either throw or fall back to the JIT interpreter for execution
+  tvm::relay::Function tvm_func;
+  try {
+    QParamsGuard qparams_guard(&qparams);
+    std::vector<NodeOps> node_ops;
+    bool record_ops = profileOps() && !std::atomic_load(&node_ops_);
+    tvm_func = convertToRelay(
+        subgraph_,
+        ctx_,
+        nullptr,
+        layout.enabled() ? &layout : nullptr,
+        record_ops ? &node_ops : nullptr);
+    if (record_ops) {
+      std::atomic_store(
+          &node_ops_,
+          std::make_shared<const std::vector<NodeOps>>(std::move(node_ops)));
+    }
+    if (!qparams.empty()) {
+      tvm_func = canonicalizeQNN(tvm_func);
+    }
+    tvm_func = toMixedPrecision(tvm_func, precision_);
+  } catch (const std::exception& e) {
+    if (strict_) {
+      AT_ERROR("Pytorch TVM: fail to convert to relay, exception: ", e.what());
+    }
+    LOG(WARNING)
+        << "Pytorch TVM: fail to convert to relay, falling back to JIT for execution, exception: "
+        << e.what() << "\n";
+    conversion_failures++;
+    // Remember the failure so later calls go straight to the interpreter
+    auto entry = std::make_shared<TVMCacheEntry>();
+    entry->convert_failed = true;
+    publish(spec, entry);
+    if (bucket_spec) {
+      publish(*bucket_spec, entry);
+    }
+    return entry;
+  }
+
+  auto entry = std::make_shared<TVMCacheEntry>();
+  entry->dispatch = dispatch;
+  entry->key = key;
+  entry->input_qparams = input_qparams;
+  entry->output_qparams = output_qparams;
+  // Tiering is skipped while recording, as the archive must hold optimized
+  // kernels
+  bool tiered = hot_threshold_ > 0 && !isRecordingArtifacts();
+  int build_opt_level = opt_level_;
+  int build_tier = kTierOptimized;
+  if (tiered) {
+    entry->func = tvm_func;
+    entry->buckets = buckets;
+    // Baseline kernels are cheap to rebuild and never cached
+    key.clear();
+    build_opt_level = tier0_opt_level_;
+    build_tier = kTierBaseline;
+  }
+  if (tiered && tier0_opt_level_ < 0) {
+    // Served by the interpreter until the spec is hot
+  } else if (async_compile_ && !isRecordingArtifacts()) {
+    // Recording for an archive needs every artifact before the run returns,
+    // otherwise calls are served by the interpreter until the build finishes
+    compileAsync(entry, tvm_func, buckets, key, build_opt_level, build_tier);
+  } else {
+    installKernel(
+        entry,
+        compile(tvm_func, buckets, key, build_opt_level),
+        build_tier);
+  }
+  publish(spec, entry);
+  if (bucket_spec) {
+    publish(*bucket_spec, entry);
+  }
+  return entry;
 }
 
 void TVMCompiler::run(Stack& stack) {
-  std::unordered_map<Value*, IValue> value_to_ivalue;
   int num_inputs = subgraph_->inputs().size();
   at::ArrayRef<IValue> inputs = last(stack, num_inputs);
+  CompleteArgumentSpec spec{false, ArrayRef<IValue>(inputs)};
 
-  for (auto i = 0; i < inputs.size(); ++i) {
-    auto value_input = subgraph_->inputs()[i];
-    value_to_ivalue[value_input] = inputs[i];
+  std::shared_ptr<TVMCacheEntry> entry;
+  auto cache = std::atomic_load(&cache_);
+  auto it = cache->find(spec);
+  if (it != cache->end()) {
+    entry = it->second;
+  } else {
+    {
+      std::lock_guard<std::mutex> guard(cache_mutex_);
+      // Another thread may have handled this spec while we waited
+      cache = std::atomic_load(&cache_);
+      it = cache->find(spec);
+      entry = it != cache->end() ? it->second : createEntry(spec, inputs);
+    }
+    // A kernel may have been installed
+    KernelCacheManager::get().enforceBudget();
   }
 
-  CompleteArgumentSpec spec{false, ArrayRef<IValue>(inputs)};
+  auto calls = entry->calls.fetch_add(1, std::memory_order_relaxed) + 1;
+  if (hot_threshold_ > 0 && calls >= hot_threshold_ && entry->func.defined() &&
+      entry->tier != kTierOptimized && !entry->promoting.exchange(true)) {
+    compileAsync(
+        entry,
+        entry->func,
+        entry->buckets,
+        entry->key,
+        opt_level_,
+        kTierOptimized);
+  }
+
+  auto obj = std::atomic_load(&entry->obj);
+  if (obj && entry->tier == kTierOptimized && isRecordingArtifacts()) {
+    // Kernels compiled before recording started are cache hits
+    recordArtifact(entry->key, obj->artifact);
+  }
+  if (!obj || entry->dispatch == kDispatchJIT) {
+    runFallback(stack);
+    return;
+  }
+  // Quantization parameters are not part of the spec, inputs quantized
+  // differently than the kernel assumes run in the interpreter
+  if (!entry->input_qparams.empty() &&
+      qparamsOf(inputs) != entry->input_qparams) {
+    runFallback(stack);
+    return;
+  }
+  if (torch::autograd::GradMode::is_enabled() &&
+      std::any_of(inputs.begin(), inputs.end(), [](const IValue& input) {
+        return input.toTensor().requires_grad();
+      })) {
+    runTraining(stack, entry, obj);
+    return;
+  }
+  // Baseline kernels are not representative of the final performance
+  if (profile_runs_ > 0 && entry->dispatch == kDispatchUndecided &&
+      entry->tier == kTierOptimized) {
+    runProfiled(stack, *entry, obj);
+    return;
+  }
+  runKernel(stack, *entry, obj);
+}
+
+// Runs the kernels of runtime.  When profiling, the debug runtime runs the
+// graph once and then each kernel once more on its own to time it.  The
+// timings are marked in the autograd profiler's events at the point they
+// end, for torch_tvm.profile to expand.
+static void runGraph(TVMRuntime& runtime, const TVMObject& obj) {
+  if (runtime.run_individual == nullptr) {
+    runtime.kernel();
+    return;
+  }
+  std::string times = runtime.run_individual(1, 1, 0);
+  auto id = recordKernelTimes(obj.kernels, times);
+  RECORD_FUNCTION(kernelTimesMarker(id), std::vector<c10::IValue>());
+}
+
+// Autograd node of a compilation group run by TVM, running the backward
+// kernel of its spec
+struct TVMBackward : public torch::autograd::Function {
+  TVMBackward(
+      std::shared_ptr<TVMCompiler> compiler,
+      std::shared_ptr<TVMObject> forward,
+      std::shared_ptr<TVMObject> backward,
+      const torch::autograd::variable_list& inputs)
+      : compiler_(std::move(compiler)),
+        forward_(std::move(forward)),
+        backward_(std::move(backward)) {
+    for (const auto& input : inputs) {
+      inputs_.emplace_back(input, /*is_output=*/false);
+    }
+  }
 
-  if (cache_.find(spec) == cache_.end()) {
-    for (auto& kv : value_to_ivalue) {
-      kv.first->inferTypeFrom(kv.second.toTensor());
+  torch::autograd::variable_list apply(
+      torch::autograd::variable_list&& grads) override {
+    // The backward kernel takes the forward inputs and the output grads
+    std::vector<at::Tensor> bound;
+    for (const auto& input : inputs_) {
+      bound.emplace_back(input.unpack().contiguous());
+    }
+    for (size_t i = 0; i < grads.size(); ++i) {
+      bound.emplace_back(
+          grads[i].defined() ? grads[i].contiguous()
+                             : at::zeros(
+                                   forward_->output_shapes[i],
+                                   forward_->output_options[i]));
+    }
+    backward_->markUsed();
+    auto runtime = compiler_->acquireRuntime(*backward_);
+    for (size_t i = 0; i < bound.size(); ++i) {
+      runtime->set_input(i, asTVMArray(bound[i]));
+    }
+    configureThreadPool();
+    runGraph(*runtime, *backward_);
+    torch::autograd::variable_list input_grads;
+    for (size_t i = 0; i < inputs_.size(); ++i) {
+      if (!should_compute_output(i)) {
+        input_grads.emplace_back();
+        continue;
+      }
+      // Copied out of the runtime's storage, which the next call reuses
+      tvm::runtime::NDArray grad = runtime->get_output(i);
+      input_grads.emplace_back(
+          torch::autograd::make_variable(fromTVMArray(grad).clone()));
     }
-    // bail out mechanism: try to convert to Relay, if it fails to convert the
-    // graph by any reason(i.e. op difference), depend on the user preference,
-    // either throw or fall back to the JIT interpreter for execution
-    tvm::relay::Function tvm_func;
+    compiler_->releaseRuntime(*backward_, std::move(runtime));
+    return input_grads;
+  }
+
+  void release_variables() override {
+    inputs_.clear();
+  }
+
+ private:
+  std::shared_ptr<TVMCompiler> compiler_;
+  std::shared_ptr<TVMObject> forward_;
+  std::shared_ptr<TVMObject> backward_;
+  std::vector<torch::autograd::SavedVariable> inputs_;
+};
+
+void TVMCompiler::runTraining(
+    Stack& stack,
+    const std::shared_ptr<TVMCacheEntry>& entry,
+    const std::shared_ptr<TVMObject>& obj) {
+  int num_inputs = subgraph_->inputs().size();
+  at::ArrayRef<IValue> inputs = last(stack, num_inputs);
+  // Blocked, quantized, padded and in-place updated inputs are not
+  // differentiated
+  std::shared_ptr<TVMObject> backward;
+  if (!layout_.enabled() && !inplace_.enabled() &&
+      entry->input_qparams.empty() && obj->buckets.dims.empty()) {
+    backward = backwardKernel(entry, inputs);
+  }
+  if (!backward) {
+    runFallback(stack);
+    return;
+  }
+  torch::autograd::variable_list input_vars;
+  for (const auto& input : inputs) {
+    input_vars.emplace_back(input.toTensor());
+  }
+  runKernel(stack, *entry, obj);
+  auto grad_fn = std::make_shared<TVMBackward>(
+      shared_from_this(), obj, std::move(backward), input_vars);
+  grad_fn->set_next_edges(torch::autograd::collect_next_edges(input_vars));
+  auto num_outputs = subgraph_->outputs().size();
+  for (size_t i = 0; i < num_outputs; ++i) {
+    auto output = stack[stack.size() - num_outputs + i].toTensor();
+    torch::autograd::set_history(output, grad_fn);
+  }
+}
+
+std::shared_ptr<TVMObject> TVMCompiler::backwardKernel(
+    const std::shared_ptr<TVMCacheEntry>& entry,
+    at::ArrayRef<IValue> inputs) {
+  std::shared_ptr<TVMObject> backward;
+  {
+    std::lock_guard<std::mutex> guard(entry->backward_mutex);
+    if (entry->backward || entry->backward_failed || entry->backward_building) {
+      return entry->backward;
+    }
+    tvm::relay::Function forward;
     try {
-      tvm_func = convertToRelay(subgraph_, ctx_, &cache_[spec].input_values);
-    } catch (const std::exception& e) {
-      if (strict_) {
-        AT_ERROR(
-            "Pytorch TVM: fail to convert to relay, exception: ", e.what());
+      // The types of the subgraph are shared by all specs
+      std::lock_guard<std::mutex> cache_guard(cache_mutex_);
+      for (size_t i = 0; i < inputs.size(); ++i) {
+        subgraph_->inputs()[i]->inferTypeFrom(inputs[i].toTensor());
       }
+      forward = convertToRelay(subgraph_, ctx_);
+    } catch (const std::exception& e) {
       LOG(WARNING)
-          << "Pytorch TVM: fail to convert to relay, falling back to JIT for execution, exception: "
+          << "Pytorch TVM: fail to build the backward, falling back to JIT for training, exception: "
           << e.what() << "\n";
-      InterpreterState(Code(subgraph_)).run(stack);
-      return;
+      entry->backward_failed = true;
+      return nullptr;
     }
-    auto build_f = build_mod_.GetFunction("build", false);
-    auto json_f = build_mod_.GetFunction("get_graph_json", false);
-    auto mod_f = build_mod_.GetFunction("get_module", false);
-    tvm::Map<tvm::Integer, tvm::Target> target_map = {
-        {ctx_.device_type, tvm::Target::Create(device_)}};
-    build_f(tvm_func, target_map, tvm::Target::Create(host_));
-    std::string json = json_f();
-    tvm::runtime::Module mod = mod_f();
-    auto pfr = tvm::runtime::Registry::Get("tvm.graph_runtime.create");
-    AT_ASSERT(pfr);
-    tvm::runtime::Module run_mod =
-        (*pfr)(json, mod, (int)ctx_.device_type, (int)ctx_.device_id);
-    cache_[spec].set_input = run_mod.GetFunction("set_input_zero_copy", false);
-    cache_[spec].kernel = run_mod.GetFunction("run", false);
-    cache_[spec].get_output = run_mod.GetFunction("get_output", false);
-    auto get_num_outputs = run_mod.GetFunction("get_num_outputs", false);
-    int n = get_num_outputs();
-    AT_CHECK(
-        subgraph_->outputs().size() == n,
-        "Compiled subgraph with mismatching num outputs");
+    if (async_compile_) {
+      // Training calls run in the interpreter until the build finishes
+      entry->backward_building = true;
+      auto self = shared_from_this();
+      auto num_inputs = inputs.size();
+      enqueueCompile([self, entry, forward, num_inputs]() {
+        auto backward = self->buildBackward(entry, forward, num_inputs);
+        {
+          std::lock_guard<std::mutex> guard(entry->backward_mutex);
+          entry->backward_building = false;
+          entry->backward = backward;
+          entry->backward_failed = !backward;
+        }
+        KernelCacheManager::get().enforceBudget();
+      });
+      return nullptr;
+    }
+    // Concurrent training calls of the spec wait for the build
+    backward = buildBackward(entry, forward, inputs.size());
+    entry->backward = backward;
+    entry->backward_failed = !backward;
+  }
+  if (backward) {
+    KernelCacheManager::get().enforceBudget();
+  }
+  return backward;
+}
+
+std::shared_ptr<TVMObject> TVMCompiler::buildBackward(
+    const std::shared_ptr<TVMCacheEntry>& entry,
+    const tvm::relay::Function& forward,
+    size_t num_inputs) {
+  std::shared_ptr<TVMObject> backward;
+  try {
+    backward = instantiate(
+        build(makeBackward(forward), opt_level_),
+        BucketedShapes(),
+        num_inputs,
+        /*forward=*/false);
+  } catch (const std::exception& e) {
+    LOG(WARNING)
+        << "Pytorch TVM: fail to build the backward, falling back to JIT for training, exception: "
+        << e.what() << "\n";
+    return nullptr;
   }
+  // Evicted with the forward kernels of the entry
+  KernelCacheManager::get().track(
+      shared_from_this(), entry, backward.get(), initialBytes(*backward));
+  return backward;
+}
+
+void TVMCompiler::runProfiled(
+    Stack& stack,
+    TVMCacheEntry& entry,
+    const std::shared_ptr<TVMObject>& obj) {
+  bool use_tvm;
+  {
+    std::lock_guard<std::mutex> guard(entry.profile_mutex);
+    use_tvm = entry.tvm_samples <= entry.jit_samples;
+  }
+  auto start = std::chrono::steady_clock::now();
+  if (use_tvm) {
+    runKernel(stack, entry, obj);
+  } else {
+    profile_calls++;
+    runInterpreter(stack);
+  }
+  double us = std::chrono::duration<double, std::micro>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+
+  std::lock_guard<std::mutex> guard(entry.profile_mutex);
+  auto& samples = use_tvm ? entry.tvm_samples : entry.jit_samples;
+  auto& best_us = use_tvm ? entry.tvm_best_us : entry.jit_best_us;
+  // The first call of each backend includes one-time setup
+  if (samples++ > 0) {
+    best_us = std::min(best_us, us);
+  }
+  if (entry.dispatch != kDispatchUndecided ||
+      std::min(entry.tvm_samples, entry.jit_samples) <= profile_runs_) {
+    return;
+  }
+  DispatchDecision decision;
+  decision.tvm_us = entry.tvm_best_us;
+  decision.jit_us = entry.jit_best_us;
+  decision.use_tvm = decision.tvm_us <= decision.jit_us;
+  decision.ops = group_ops_;
+  DispatchTable::get().record(entry.key, decision);
+  entry.dispatch = decision.use_tvm ? kDispatchTVM : kDispatchJIT;
+  if (!decision.use_tvm) {
+    // Release the kernel's memory, it is not going to run again
+    std::atomic_store(&entry.obj, std::shared_ptr<TVMObject>());
+  }
+}
 
-  for (auto i = 0; i < cache_[spec].input_values.size(); ++i) {
-    auto* value = cache_[spec].input_values[i];
-    if (!value_to_ivalue.count(value)) {
-      auto optional_ivalue = toIValue(value);
-      AT_ASSERT(optional_ivalue.has_value());
-      value_to_ivalue[value] = optional_ivalue.value();
+void TVMCompiler::runKernel(
+    Stack& stack,
+    const TVMCacheEntry& entry,
+    const std::shared_ptr<TVMObject>& obj) {
+  std::unordered_map<Value*, IValue> value_to_ivalue;
+  int num_inputs = subgraph_->inputs().size();
+  at::ArrayRef<IValue> inputs = last(stack, num_inputs);
+  for (auto i = 0; i < inputs.size(); ++i) {
+    auto value_input = subgraph_->inputs()[i];
+    value_to_ivalue[value_input] = inputs[i];
+  }
+
+  obj->markUsed();
+  bool created_runtime;
+  auto runtime = acquireRuntime(*obj, &created_runtime);
+  // Actual sizes of the bucketed dimensions, used to slice outputs back
+  std::vector<int64_t> actual_sizes(obj->buckets.dims.size(), -1);
+  for (auto i = 0; i < obj->input_values.size(); ++i) {
+    auto ivalue = value_to_ivalue.at(obj->input_values[i]);
+    auto tensor = ivalue.toTensor();
+    // Kernels take quantized tensors as their integer representation
+    bool quantized = tensor.is_quantized();
+    if (i < obj->buckets.padded_shapes.size() &&
+        !obj->buckets.padded_shapes[i].empty()) {
+      const auto& shape = obj->buckets.padded_shapes[i];
+      for (size_t d = 0; d < obj->buckets.dims.size(); ++d) {
+        auto dim = obj->buckets.dims[d].first;
+        if (dim < tensor.dim()) {
+          actual_sizes[d] = tensor.size(dim);
+        }
+      }
+      // Inputs already of the bucket shape are bound without a copy
+      if (tensor.sizes() != at::IntArrayRef(shape)) {
+        if (quantized) {
+          tensor = tensor.int_repr();
+          quantized = false;
+        }
+        runtime->padded_inputs.resize(obj->buckets.padded_shapes.size());
+        auto& padded = runtime->padded_inputs[i];
+        if (!padded.defined()) {
+          padded = at::zeros(shape, tensor.options());
+        }
+        // Rows past the actual sizes are never read back, so stale data
+        // left there by previous calls is harmless
+        auto dst = padded;
+        for (const auto& dim : obj->buckets.dims) {
+          if (dim.first < dst.dim()) {
+            dst = dst.narrow(dim.first, 0, tensor.size(dim.first));
+          }
+        }
+        dst.copy_(tensor);
+        tensor = padded;
+      }
     }
-    auto ivalue = value_to_ivalue.at(cache_[spec].input_values[i]);
-    auto tensor = ivalue.toTensor().to(at::kFloat);
-    auto dl_tensor = at::toDLPack(tensor);
-    cache_[spec].set_input(i, tvm::runtime::NDArray::FromDLPack(dl_tensor));
+    runtime->set_input(
+        i, quantized ? quantizedTVMArray(tensor) : asTVMArray(tensor));
   }
 
-  cache_[spec].kernel();
+  // Outputs are fresh arrays wrapped as ATen tensors.  The runtime writes
+  // into them directly when it supports binding outputs, which needs
+  // set_output_zero_copy (newer than the pinned TVM), otherwise they are
+  // copied out of the runtime's storage after the run, as that storage is
+  // reused by whichever call checks the runtime out next.
+  bool bind_outputs = runtime->set_output != nullptr;
+  std::vector<at::Tensor> outputs;
+  std::vector<tvm::runtime::NDArray> output_arrays;
+  std::vector<at::Tensor> updated(obj->num_outputs);
+  for (size_t i = 0; i < updated.size(); ++i) {
+    auto input = inplace_.inputOf(i);
+    if (input >= 0) {
+      updated[i] = inputs[input].toTensor();
+    }
+  }
+  for (size_t i = 0; i < obj->output_shapes.size(); ++i) {
+    // In-place updates are written straight into the input they update.
+    // Bound before the run, this needs the kernel not to otherwise read the
+    // input, and profiled runtimes run the graph twice, which would apply
+    // the update twice.
+    const auto& input = updated[i];
+    bool into_input = input.defined() && input.is_contiguous() &&
+        input.sizes() == at::IntArrayRef(obj->output_shapes[i]) &&
+        input.dtype() == obj->output_options[i].dtype() &&
+        (!bind_outputs ||
+         (inplace_.zero_copy[i] && runtime->run_individual == nullptr));
+    if (into_input) {
+      outputs.emplace_back(input);
+      output_arrays.emplace_back(asTVMArray(input));
+    } else {
+      auto array = tvm::runtime::NDArray::Empty(
+          obj->output_shapes[i], obj->output_dtypes[i], ctx_);
+      output_arrays.emplace_back(array);
+      outputs.emplace_back(
+          wrapTVMArray(std::move(array), obj->output_options[i]));
+    }
+    if (bind_outputs) {
+      runtime->set_output(i, output_arrays[i]);
+    }
+  }
+
+  configureThreadPool();
+  runGraph(*runtime, *obj);
+  if (!bind_outputs) {
+    for (size_t i = 0; i < output_arrays.size(); ++i) {
+      runtime->get_output(i, output_arrays[i]);
+    }
+  }
 
   // clean the stack and add outputs to the stack
   drop(stack, num_inputs);
-  int i = 0;
-  for (const auto& output : subgraph_->outputs()) {
-    tvm::runtime::NDArray ret_val = cache_[spec].get_output(i);
-    auto dl_tensor = ret_val.ToDLPack();
-    auto tensor = at::fromDLPack(dl_tensor);
+  for (size_t i = 0; i < subgraph_->outputs().size(); ++i) {
+    at::Tensor tensor = outputs[i];
+    for (size_t d = 0; d < obj->buckets.dims.size(); ++d) {
+      auto dim = obj->buckets.dims[d].first;
+      auto bucket = obj->buckets.dims[d].second;
+      if (dim < tensor.dim() && tensor.size(dim) == bucket &&
+          actual_sizes[d] != -1) {
+        tensor = tensor.narrow(dim, 0, actual_sizes[d]);
+      }
+    }
+    if (i < entry.output_qparams.size() &&
+        entry.output_qparams[i].quantized()) {
+      tensor = toQuantized(tensor, entry.output_qparams[i]);
+    }
+    if (updated[i].defined()) {
+      // The rest of the graph observes the update through the input
+      if (!tensor.is_same(updated[i])) {
+        updated[i].copy_(tensor);
+      }
+      stack.push_back(IValue(updated[i]));
+      continue;
+    }
     auto var = torch::autograd::make_variable(tensor);
     stack.push_back(IValue(var));
-    i++;
+  }
+  releaseRuntime(*obj, std::move(runtime));
+  // Only a new runtime adds bytes, checking the budget on every call would
+  // contend on the manager once over it
+  if (created_runtime) {
+    KernelCacheManager::get().enforceBudget();
   }
 }
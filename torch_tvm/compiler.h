@@ -1,6 +1,7 @@
 #pragma once
 
 #include <torch/csrc/jit/argument_spec.h>
+#include <torch/csrc/jit/interpreter.h>
 #include <torch/csrc/jit/ir.h>
 #include <tvm/relay/expr.h>
 #include <tvm/relay/op.h>
@@ -8,36 +9,340 @@
 #include <tvm/build_module.h>
 #include <tvm/operation.h>
 
+#include "bucketing.h"
+#include "disk_cache.h"
+#include "inplace.h"
+#include "kernel_cache.h"
+#include "layout.h"
+#include "profiling.h"
+#include "quantization.h"
+#include "workspace.h"
+
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <vector>
 
-struct TVMObject {
+// A GraphRuntime instance.  Runtimes hold per-call state (bound inputs,
+// intermediate storage) so each is used by one call at a time.
+struct TVMRuntime {
+  // The shared workspace holding the intermediate storage of mod, if any.
+  // Declared first to outlive mod.
+  std::shared_ptr<WorkspaceSlab> slab;
+  tvm::runtime::Module mod;
   tvm::PackedFunc kernel;
   tvm::PackedFunc set_input;
   tvm::PackedFunc get_output;
+  // Binds caller allocated output buffers, null if the runtime does not
+  // support it
+  tvm::PackedFunc set_output;
+  // Runs the graph and times each kernel, null unless created by the debug
+  // runtime for profile_ops
+  tvm::PackedFunc run_individual;
+  // Per input buffers holding inputs padded to their bucket shape
+  std::vector<at::Tensor> padded_inputs;
+  // Intermediate storage held by the runtime itself, as accounted by the
+  // KernelCacheManager
+  int64_t bytes = 0;
+};
+
+// The compiled form of a subgraph for a single CompleteArgumentSpec.
+// Concurrent calls each check out a runtime from the pool, all of which
+// share the compiled module and parameters.
+struct TVMObject {
+  ~TVMObject();
+
+  void markUsed() {
+    last_used.store(
+        std::chrono::steady_clock::now().time_since_epoch().count(),
+        std::memory_order_relaxed);
+  }
+
+  TVMArtifact artifact;
+  // Intermediate storage allocated by each runtime
+  int64_t storage_bytes = 0;
+  // Timestamp of the last call, or of the install for kernels yet to run,
+  // for LRU eviction
+  std::atomic<int64_t> last_used{0};
   // Map input indices to values in the subgraph
   std::vector<torch::jit::Value*> input_values;
+  size_t num_outputs = 0;
+  // Shapes the kernel was compiled for if it serves a bucket of shapes
+  BucketedShapes buckets;
+  // Outputs are allocated by ATen with these shapes and options
+  std::vector<std::vector<int64_t>> output_shapes;
+  std::vector<at::TensorOptions> output_options;
+  std::vector<DLDataType> output_dtypes;
+  // Placement of the intermediate storage of runtimes in the shared
+  // workspace, disabled if not in use
+  WorkspacePlan workspace;
+  // The runtime whose params all other runtimes share, and its slab.  Set
+  // by the first runtime, and handed to another runtime if its slab is
+  // orphaned.  Guarded by runtimes_mutex.
+  std::shared_ptr<WorkspaceSlab> params_owner_slab;
+  std::unique_ptr<tvm::runtime::Module> params_owner;
+  std::vector<std::unique_ptr<TVMRuntime>> runtimes;
+  std::mutex runtimes_mutex;
+  // The kernels of the graph and the nodes they run, empty unless profiling
+  std::vector<KernelProfile> kernels;
+};
+
+// Kinds of code a cache entry runs under tiered compilation
+enum TVMTier : int {
+  kTierInterpreter = 0,
+  // Built at the cheap tier0_opt_level
+  kTierBaseline = 1,
+  // Built at the configured opt_level
+  kTierOptimized = 2,
+};
+
+// Backend chosen by profile guided dispatch
+enum TVMDispatch : int {
+  kDispatchUndecided = 0,
+  kDispatchTVM = 1,
+  kDispatchJIT = 2,
+};
+
+// A slot of the kernel cache, shared by all specs bucketed to the same
+// shapes.  The object is null until compiled and is swapped in with
+// std::atomic_store, which also replaces baseline kernels once hot.
+struct TVMCacheEntry {
+  std::shared_ptr<TVMObject> obj;
+  // The subgraph could not be converted to Relay for this spec and always
+  // runs in the interpreter
+  bool convert_failed = false;
+  std::atomic<int> tier{kTierInterpreter};
+  std::atomic<int64_t> calls{0};
+  // Set once the optimized build has been queued
+  std::atomic<bool> promoting{false};
+  // Kept under tiered compilation to rebuild at the full opt level
+  tvm::relay::Function func;
+  BucketedShapes buckets;
+  // Identifies the spec in the disk cache and the DispatchTable, empty if
+  // neither is in use
+  std::string key;
+  // Profile guided dispatch, a TVMDispatch
+  std::atomic<int> dispatch{kDispatchUndecided};
+  std::mutex profile_mutex;
+  int64_t tvm_samples = 0;
+  int64_t jit_samples = 0;
+  double tvm_best_us = std::numeric_limits<double>::infinity();
+  double jit_best_us = std::numeric_limits<double>::infinity();
+  // Quantization parameters folded into the kernel, empty if the subgraph
+  // has no quantized values
+  std::vector<QParams> input_qparams;
+  std::vector<QParams> output_qparams;
+  // Training: the backward kernel, built on the first call with inputs
+  // requiring grad (in the background with async_compile).  Until it is
+  // built, or if it cannot be, such calls run in the interpreter, which
+  // records the autograd graph of each operator.
+  std::mutex backward_mutex;
+  std::shared_ptr<TVMObject> backward;
+  bool backward_building = false;
+  bool backward_failed = false;
 };
 
-struct TVMCompiler {
+using TVMCache = std::unordered_map<
+    torch::jit::CompleteArgumentSpec,
+    std::shared_ptr<TVMCacheEntry>>;
+
+// Zero-copy conversions between ATen tensors and TVM arrays
+tvm::runtime::NDArray toTVMArray(const at::Tensor& tensor);
+at::Tensor fromTVMArray(const tvm::runtime::NDArray& array);
+// Wraps array in an ATen tensor that keeps it alive.  Kernels bind such
+// tensors back without converting them, so outputs handed from one
+// compilation group to the next stay TVM arrays.
+at::Tensor wrapTVMArray(
+    tvm::runtime::NDArray array,
+    const at::TensorOptions& options);
+// toTVMArray, returning the wrapped array of tensors made by wrapTVMArray
+tvm::runtime::NDArray asTVMArray(const at::Tensor& tensor);
+// Views the storage of a quantized tensor as its integer representation
+tvm::runtime::NDArray quantizedTVMArray(const at::Tensor& tensor);
+// Whether asTVMArray binds tensor without converting it
+bool isTVMArray(const at::Tensor& tensor);
+
+struct FallbackStats {
+  // Specs whose subgraph failed to convert to Relay
+  int64_t conversion_failures;
+  // Calls executed by the JIT interpreter instead of a TVM kernel
+  int64_t fallback_calls;
+  // Calls executed by the JIT interpreter to time it for profile guided
+  // dispatch, not counted as fallbacks
+  int64_t profile_calls;
+};
+
+FallbackStats fallbackStats();
+
+struct SpecStats {
+  int64_t group_id;
+  std::string group_ops;
+  // Input shapes of the spec
+  std::vector<std::vector<int64_t>> shapes;
+  // A TVMTier
+  int tier;
+  // Shared by all specs bucketed to the same shapes
+  int64_t calls;
+};
+
+// Sets the size of the thread pool used for background compilation
+void setCompileThreads(int num_threads);
+// When set, TVM kernels use as many threads as ATen's intra-op pool so the
+// two never oversubscribe the machine
+void setShareATenThreads(bool share);
+
+// When set, every Relay function built is kept for torch_tvm.tune, which
+// extracts the conv2d and dense workloads to tune from them
+void setRecordWorkloads(bool record);
+tvm::Array<tvm::relay::Function> recordedWorkloads();
+void clearRecordedWorkloads();
+
+// Makes compiler visible to allSpecStats
+void registerCompiler(const std::shared_ptr<TVMCompiler>& compiler);
+// Per spec tier and call counts of all live compilers
+std::vector<SpecStats> allSpecStats();
+
+struct TVMCompiler : public std::enable_shared_from_this<TVMCompiler> {
   TVMCompiler(
       const torch::jit::Node* node,
       int opt_level = 2,
       bool strict = false,
       std::string device_type = "cpu",
       std::string device = "llvm",
-      std::string host = "llvm");
+      std::string host = "llvm",
+      std::string cache_dir = "",
+      bool async_compile = false,
+      BucketingPolicy bucketing = BucketingPolicy(),
+      int hot_threshold = 0,
+      int tier0_opt_level = 0,
+      int profile_runs = 0,
+      std::string precision = "fp32");
   void run(torch::jit::Stack& stack);
+  // Drops entry from the cache, called by the KernelCacheManager
+  void evict(const std::shared_ptr<TVMCacheEntry>& entry);
+
+  int64_t groupId() const {
+    return group_id_;
+  }
+  const std::string& groupOps() const {
+    return group_ops_;
+  }
+  std::vector<SpecStats> specStats();
 
  private:
+  // Builds func, storing the artifact under key (if non-empty) in the disk
+  // cache and the recorded archive
+  std::shared_ptr<TVMObject> compile(
+      tvm::relay::Function func,
+      BucketedShapes buckets,
+      std::string key,
+      int opt_level);
+  // Compiles on the background pool and installs the result in entry
+  void compileAsync(
+      std::shared_ptr<TVMCacheEntry> entry,
+      tvm::relay::Function func,
+      BucketedShapes buckets,
+      std::string key,
+      int opt_level,
+      int tier);
+  // Accounts for obj and makes it visible to the callers of entry
+  void installKernel(
+      const std::shared_ptr<TVMCacheEntry>& entry,
+      std::shared_ptr<TVMObject> obj,
+      int tier);
+  TVMArtifact build(tvm::relay::Function func, int opt_level);
+  // Kernels of the forward graph are attributed to the nodes of the subgraph
+  // when profiling
+  std::shared_ptr<TVMObject> instantiate(
+      TVMArtifact artifact,
+      BucketedShapes buckets,
+      size_t num_outputs,
+      bool forward = true);
+  // Sets created if the runtime was created, adding its bytes to the
+  // kernel cache
+  std::unique_ptr<TVMRuntime> acquireRuntime(
+      TVMObject& obj,
+      bool* created = nullptr);
+  void releaseRuntime(TVMObject& obj, std::unique_ptr<TVMRuntime> runtime);
+  std::shared_ptr<TVMCacheEntry> createEntry(
+      const torch::jit::CompleteArgumentSpec& spec,
+      at::ArrayRef<torch::jit::IValue> inputs);
+  void publish(
+      const torch::jit::CompleteArgumentSpec& spec,
+      std::shared_ptr<TVMCacheEntry> entry);
+  // Runs the subgraph in the interpreter, counted as a fallback
+  void runFallback(torch::jit::Stack& stack);
+  void runInterpreter(torch::jit::Stack& stack);
+  void runKernel(
+      torch::jit::Stack& stack,
+      const TVMCacheEntry& entry,
+      const std::shared_ptr<TVMObject>& obj);
+  // Runs the kernel and records it in the autograd graph
+  void runTraining(
+      torch::jit::Stack& stack,
+      const std::shared_ptr<TVMCacheEntry>& entry,
+      const std::shared_ptr<TVMObject>& obj);
+  // The backward kernel of entry, null while it is built in the background
+  // or if it cannot be built
+  std::shared_ptr<TVMObject> backwardKernel(
+      const std::shared_ptr<TVMCacheEntry>& entry,
+      at::ArrayRef<torch::jit::IValue> inputs);
+  std::shared_ptr<TVMObject> buildBackward(
+      const std::shared_ptr<TVMCacheEntry>& entry,
+      const tvm::relay::Function& forward,
+      size_t num_inputs);
+  friend struct TVMBackward;
+  // Runs either backend, alternating between calls, and settles on the
+  // faster one once both have been timed profile_runs_ times
+  void runProfiled(
+      torch::jit::Stack& stack,
+      TVMCacheEntry& entry,
+      const std::shared_ptr<TVMObject>& obj);
+
   std::shared_ptr<torch::jit::Graph> subgraph_;
-  std::unordered_map<torch::jit::CompleteArgumentSpec, TVMObject> cache_;
+  // Inputs and outputs exchanged with adjacent groups in a blocked layout
+  BlockedLayout layout_;
+  // Outputs written into the storage of the input they update
+  InPlaceOutputs inplace_;
+  // Identifies the compilation group in KernelCacheStats
+  int64_t group_id_;
+  std::string group_ops_;
+  // Immutable snapshot of the cache, read without locking through
+  // std::atomic_load and replaced wholesale by publish.
+  std::shared_ptr<const TVMCache> cache_;
+  // Serializes conversion and updates to the cache
+  std::mutex cache_mutex_;
+  // Interpreter code used while a kernel is unavailable or for specs that
+  // failed to convert
+  torch::jit::Code fallback_code_;
+  std::mutex fallback_mutex_;
   TVMContext ctx_;
   int opt_level_;
   bool strict_;
   std::string device_type_;
   std::string device_;
   std::string host_;
-  tvm::runtime::Module build_mod_;
+  // Directory of the on-disk compilation cache, disabled if empty
+  std::string cache_dir_;
+  // Compile on a background thread, using the JIT until the kernel is ready
+  bool async_compile_;
+  BucketingPolicy bucketing_;
+  // Tiered compilation: specs are first built at tier0_opt_level_ (or run
+  // by the interpreter if negative) and rebuilt at opt_level_ in the
+  // background after hot_threshold_ calls.  Disabled if 0.
+  int hot_threshold_;
+  int tier0_opt_level_;
+  // Profile guided dispatch between the kernel and the interpreter,
+  // disabled if 0
+  int profile_runs_;
+  // Compute precision of convolutions and dense layers, see
+  // toMixedPrecision
+  std::string precision_;
+  // The Relay operators of each node, recorded by the first conversion
+  // under profile_ops.  Replaced with std::atomic_store.
+  std::shared_ptr<const std::vector<NodeOps>> node_ops_;
 
  public:
   static tvm::relay::Var convertToRelay(torch::jit::Value* val, TVMContext ctx);
@@ -47,5 +352,7 @@ struct TVMCompiler {
   static tvm::relay::Function convertToRelay(
       std::shared_ptr<torch::jit::Graph> subgraph,
       TVMContext ctx,
-      std::vector<torch::jit::Value*>* input_values = nullptr);
+      std::vector<torch::jit::Value*>* input_values = nullptr,
+      const BlockedLayout* layout = nullptr,
+      std::vector<NodeOps>* node_ops = nullptr);
 };
@@ -0,0 +1,382 @@
+#include "disk_cache.h"
+
+#include <dmlc/logging.h>
+#include <torch/csrc/jit/constants.h>
+#include <tvm/runtime/registry.h>
+
+#include <c10/util/Exception.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+
+using namespace torch::jit;
+
+// Bump when the layout of a cache entry changes
+static constexpr int kDiskCacheVersion = 2;
+
+static const char* kKeyFile = "key.txt";
+static const char* kGraphFile = "graph.json";
+static const char* kParamsFile = "params.bin";
+static const char* kLibFile = "lib.so";
+
+static const char kArchiveMagic[] = "TORCHTVM";
+static constexpr uint64_t kArchiveVersion = 1;
+
+uint64_t stableHash(const std::string& s) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (unsigned char c : s) {
+    h ^= c;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static std::string entryPath(
+    const std::string& cache_dir,
+    const std::string& key) {
+  std::stringstream ss;
+  ss << cache_dir << "/" << std::hex << std::setw(16) << std::setfill('0')
+     << stableHash(key);
+  return ss.str();
+}
+
+static bool makeDirs(const std::string& path) {
+  for (size_t pos = path.find('/', 1); pos != std::string::npos;
+       pos = path.find('/', pos + 1)) {
+    auto prefix = path.substr(0, pos);
+    if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) {
+      return false;
+    }
+  }
+  return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+static bool readFile(const std::string& path, std::string* contents) {
+  std::ifstream f(path, std::ios::binary);
+  if (!f) {
+    return false;
+  }
+  std::stringstream ss;
+  ss << f.rdbuf();
+  *contents = ss.str();
+  return static_cast<bool>(f);
+}
+
+static bool writeFile(const std::string& path, const std::string& contents) {
+  std::ofstream f(path, std::ios::binary);
+  f << contents;
+  return static_cast<bool>(f);
+}
+
+static void removeEntry(const std::string& path) {
+  for (const auto* file : {kKeyFile, kGraphFile, kParamsFile, kLibFile}) {
+    std::remove((path + "/" + file).c_str());
+  }
+  rmdir(path.c_str());
+}
+
+static std::mutex tuning_mutex;
+// Hash of the contents of the applied tuning log, empty if none
+static std::string tuning_key;
+
+void setTuningLog(const std::string& path) {
+  std::string key;
+  if (!path.empty()) {
+    std::ifstream is(path, std::ios::binary);
+    AT_CHECK(is, "Pytorch TVM: cannot read tuning log ", path);
+    std::stringstream contents;
+    contents << is.rdbuf();
+    std::ostringstream hash;
+    hash << std::hex << stableHash(contents.str());
+    key = hash.str();
+  }
+  std::lock_guard<std::mutex> guard(tuning_mutex);
+  tuning_key = key;
+}
+
+std::string diskCacheKey(
+    const Graph& subgraph,
+    const CompleteArgumentSpec& spec,
+    int opt_level,
+    const std::string& device,
+    const std::string& host) {
+  std::stringstream ss;
+  ss << "version: " << kDiskCacheVersion << "\n";
+  ss << "opt_level: " << opt_level << "\n";
+  ss << "device: " << device << "\n";
+  ss << "host: " << host << "\n";
+  {
+    std::lock_guard<std::mutex> guard(tuning_mutex);
+    if (!tuning_key.empty()) {
+      ss << "tuning: " << tuning_key << "\n";
+    }
+  }
+  for (size_t i = 0; i < spec.size(); ++i) {
+    const auto& arg = spec.at(i);
+    ss << "input " << i << ": ";
+    if (!arg.isTensor()) {
+      ss << "non-tensor\n";
+      continue;
+    }
+    if (!arg.defined()) {
+      ss << "undefined\n";
+      continue;
+    }
+    ss << at::toString(arg.type()) << " sizes " << arg.sizes() << " strides "
+       << arg.strides() << "\n";
+  }
+  // Constant tensors are baked into the params, but only printed as
+  // <Tensor> in the IR
+  for (const auto* node : subgraph.nodes()) {
+    if (node->kind() != prim::Constant) {
+      continue;
+    }
+    auto ivalue = toIValue(node->output());
+    if (!ivalue || !ivalue->isTensor()) {
+      continue;
+    }
+    auto tensor = ivalue->toTensor().contiguous();
+    std::string data(
+        static_cast<const char*>(tensor.data_ptr()),
+        tensor.numel() * tensor.element_size());
+    ss << "constant " << node->output()->debugName() << ": "
+       << at::toString(tensor.scalar_type()) << " " << tensor.sizes() << " "
+       << std::hex << stableHash(data) << std::dec << "\n";
+  }
+  ss << subgraph;
+  return ss.str();
+}
+
+bool loadFromDiskCache(
+    const std::string& cache_dir,
+    const std::string& key,
+    TVMArtifact* artifact) {
+  auto path = entryPath(cache_dir, key);
+  std::string stored_key;
+  if (!readFile(path + "/" + kKeyFile, &stored_key)) {
+    return false;
+  }
+  // Guard against hash collisions
+  if (stored_key != key) {
+    LOG(WARNING) << "Pytorch TVM: disk cache collision at " << path << "\n";
+    return false;
+  }
+  TVMArtifact loaded;
+  if (!readFile(path + "/" + kGraphFile, &loaded.graph_json) ||
+      !readFile(path + "/" + kParamsFile, &loaded.params)) {
+    return false;
+  }
+  try {
+    loaded.lib = tvm::runtime::Module::LoadFromFile(path + "/" + kLibFile);
+  } catch (const std::exception& e) {
+    LOG(WARNING) << "Pytorch TVM: failed to load cached module from " << path
+                 << ", exception: " << e.what() << "\n";
+    return false;
+  }
+  *artifact = std::move(loaded);
+  return true;
+}
+
+void saveToDiskCache(
+    const std::string& cache_dir,
+    const std::string& key,
+    const TVMArtifact& artifact) {
+  // Exporting a library requires invoking the system compiler, which TVM
+  // only exposes through its Python package (see __init__.py)
+  auto export_f = tvm::runtime::Registry::Get("torch_tvm._export_library");
+  if (!export_f) {
+    LOG(WARNING) << "Pytorch TVM: torch_tvm._export_library is not "
+                 << "registered, not writing to disk cache\n";
+    return;
+  }
+  if (!makeDirs(cache_dir)) {
+    LOG(WARNING) << "Pytorch TVM: cannot create cache directory " << cache_dir
+                 << "\n";
+    return;
+  }
+  auto path = entryPath(cache_dir, key);
+  std::string tmp_template = cache_dir + "/.tmp-XXXXXX";
+  std::vector<char> tmp_buf(tmp_template.begin(), tmp_template.end());
+  tmp_buf.push_back('\0');
+  if (!mkdtemp(tmp_buf.data())) {
+    LOG(WARNING) << "Pytorch TVM: cannot create temporary directory in "
+                 << cache_dir << "\n";
+    return;
+  }
+  std::string tmp_path(tmp_buf.data());
+
+  bool ok = writeFile(tmp_path + "/" + kGraphFile, artifact.graph_json) &&
+      writeFile(tmp_path + "/" + kParamsFile, artifact.params);
+  if (ok) {
+    try {
+      (*export_f)(artifact.lib, tmp_path + "/" + kLibFile);
+    } catch (const std::exception& e) {
+      LOG(WARNING) << "Pytorch TVM: failed to export module, exception: "
+                   << e.what() << "\n";
+      ok = false;
+    }
+  }
+  // The key is written last as its presence marks a complete entry
+  ok = ok && writeFile(tmp_path + "/" + kKeyFile, key);
+  // If another process published the same entry first, rename fails and we
+  // simply discard our copy
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    removeEntry(tmp_path);
+  }
+}
+
+static std::mutex artifacts_mutex;
+// Read without the lock by every kernel call
+static std::atomic<bool> recording{false};
+static int64_t recorded_calls = 0;
+static std::unordered_map<std::string, TVMArtifact> recorded_artifacts;
+static std::unordered_map<std::string, TVMArtifact> preloaded_artifacts;
+
+void startRecordingArtifacts() {
+  std::lock_guard<std::mutex> guard(artifacts_mutex);
+  recording = true;
+  recorded_artifacts.clear();
+}
+
+void stopRecordingArtifacts() {
+  std::lock_guard<std::mutex> guard(artifacts_mutex);
+  recording = false;
+  recorded_artifacts.clear();
+}
+
+bool isRecordingArtifacts() {
+  return recording.load(std::memory_order_relaxed);
+}
+
+void recordArtifact(const std::string& key, const TVMArtifact& artifact) {
+  std::lock_guard<std::mutex> guard(artifacts_mutex);
+  if (recording) {
+    recorded_artifacts[key] = artifact;
+    recorded_calls++;
+  }
+}
+
+int64_t recordedArtifactCalls() {
+  std::lock_guard<std::mutex> guard(artifacts_mutex);
+  return recorded_calls;
+}
+
+static void writeBlob(std::ostream& os, const std::string& blob) {
+  uint64_t size = blob.size();
+  os.write(reinterpret_cast<const char*>(&size), sizeof(size));
+  os.write(blob.data(), size);
+}
+
+static std::string readBlob(std::istream& is) {
+  uint64_t size = 0;
+  is.read(reinterpret_cast<char*>(&size), sizeof(size));
+  AT_CHECK(is, "Pytorch TVM: truncated archive");
+  std::string blob(size, '\0');
+  is.read(&blob[0], size);
+  AT_CHECK(is, "Pytorch TVM: truncated archive");
+  return blob;
+}
+
+// Creates a temporary file with the given suffix, returning its path
+static std::string makeTempFile(const std::string& suffix) {
+  const char* tmpdir = getenv("TMPDIR");
+  std::string tmp_template =
+      std::string(tmpdir ? tmpdir : "/tmp") + "/torch_tvm-XXXXXX" + suffix;
+  std::vector<char> tmp_buf(tmp_template.begin(), tmp_template.end());
+  tmp_buf.push_back('\0');
+  int fd = mkstemps(tmp_buf.data(), suffix.size());
+  AT_CHECK(fd != -1, "Pytorch TVM: cannot create temporary file");
+  close(fd);
+  return std::string(tmp_buf.data());
+}
+
+int64_t writeArchive(const std::string& path) {
+  std::unordered_map<std::string, TVMArtifact> artifacts;
+  {
+    std::lock_guard<std::mutex> guard(artifacts_mutex);
+    artifacts = recorded_artifacts;
+  }
+  auto export_f = tvm::runtime::Registry::Get("torch_tvm._export_library");
+  AT_CHECK(export_f, "Pytorch TVM: torch_tvm._export_library is not registered");
+
+  std::ofstream os(path, std::ios::binary);
+  AT_CHECK(os, "Pytorch TVM: cannot open ", path, " for writing");
+  os.write(kArchiveMagic, sizeof(kArchiveMagic));
+  uint64_t header[2] = {kArchiveVersion, artifacts.size()};
+  os.write(reinterpret_cast<const char*>(header), sizeof(header));
+  for (const auto& kv : artifacts) {
+    auto lib_path = makeTempFile(".so");
+    std::string lib;
+    (*export_f)(kv.second.lib, lib_path);
+    bool read = readFile(lib_path, &lib);
+    std::remove(lib_path.c_str());
+    AT_CHECK(read, "Pytorch TVM: cannot read exported library ", lib_path);
+    writeBlob(os, kv.first);
+    writeBlob(os, kv.second.graph_json);
+    writeBlob(os, kv.second.params);
+    writeBlob(os, lib);
+  }
+  AT_CHECK(os, "Pytorch TVM: failed to write ", path);
+  return artifacts.size();
+}
+
+int64_t loadArchive(const std::string& path) {
+  std::ifstream is(path, std::ios::binary);
+  AT_CHECK(is, "Pytorch TVM: cannot open ", path);
+  char magic[sizeof(kArchiveMagic)];
+  is.read(magic, sizeof(magic));
+  AT_CHECK(
+      is && std::equal(magic, magic + sizeof(magic), kArchiveMagic),
+      "Pytorch TVM: ",
+      path,
+      " is not a torch_tvm archive");
+  uint64_t header[2];
+  is.read(reinterpret_cast<char*>(header), sizeof(header));
+  AT_CHECK(
+      is && header[0] == kArchiveVersion,
+      "Pytorch TVM: unsupported archive version");
+
+  std::unordered_map<std::string, TVMArtifact> artifacts;
+  for (uint64_t i = 0; i < header[1]; ++i) {
+    auto key = readBlob(is);
+    TVMArtifact artifact;
+    artifact.graph_json = readBlob(is);
+    artifact.params = readBlob(is);
+    // Shared libraries can only be loaded from a file, which may be removed
+    // once it is mapped
+    auto lib_path = makeTempFile(".so");
+    bool written = writeFile(lib_path, readBlob(is));
+    if (written) {
+      artifact.lib = tvm::runtime::Module::LoadFromFile(lib_path);
+    }
+    std::remove(lib_path.c_str());
+    AT_CHECK(written, "Pytorch TVM: cannot write ", lib_path);
+    artifacts[key] = std::move(artifact);
+  }
+
+  std::lock_guard<std::mutex> guard(artifacts_mutex);
+  for (auto& kv : artifacts) {
+    preloaded_artifacts[kv.first] = std::move(kv.second);
+  }
+  return header[1];
+}
+
+bool findPreloadedArtifact(const std::string& key, TVMArtifact* artifact) {
+  std::lock_guard<std::mutex> guard(artifacts_mutex);
+  auto it = preloaded_artifacts.find(key);
+  if (it == preloaded_artifacts.end()) {
+    return false;
+  }
+  *artifact = it->second;
+  return true;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <torch/csrc/jit/argument_spec.h>
+#include <torch/csrc/jit/ir.h>
+#include <tvm/runtime/module.h>
+
+#include <string>
+
+// Everything needed to instantiate a GraphRuntime without invoking the
+// Relay build pipeline.
+struct TVMArtifact {
+  std::string graph_json;
+  tvm::runtime::Module lib;
+  // Serialized with relay's save_param_dict, consumable by load_params
+  std::string params;
+};
+
+// FNV-1a, used instead of std::hash as the result must be stable across
+// builds and processes
+uint64_t stableHash(const std::string& s);
+
+// Builds the key identifying a compiled subgraph.  The key is derived from
+// the printed subgraph IR, the complete argument spec, the compilation
+// options and the applied tuning log, so it is stable across process
+// restarts.
+std::string diskCacheKey(
+    const torch::jit::Graph& subgraph,
+    const torch::jit::CompleteArgumentSpec& spec,
+    int opt_level,
+    const std::string& device,
+    const std::string& host);
+
+// Sets the AutoTVM log applied to builds, whose contents are hashed into
+// the keys of subsequent specs.  Empty if none.
+void setTuningLog(const std::string& path);
+
+// Returns false (and leaves artifact untouched) on a miss or if the entry
+// could not be read for any reason.
+bool loadFromDiskCache(
+    const std::string& cache_dir,
+    const std::string& key,
+    TVMArtifact* artifact);
+
+// Entries are written to a private temporary directory and published with an
+// atomic rename, so several processes can share one cache directory.
+// Failures are logged and otherwise ignored.
+void saveToDiskCache(
+    const std::string& cache_dir,
+    const std::string& key,
+    const TVMArtifact& artifact);
+
+// Ahead-of-time archives bundle the artifacts compiled for a model into a
+// single file, letting deployments skip the Relay build entirely.
+
+// While recording, every artifact built or loaded is kept for writeArchive
+void startRecordingArtifacts();
+void stopRecordingArtifacts();
+bool isRecordingArtifacts();
+void recordArtifact(const std::string& key, const TVMArtifact& artifact);
+// Number of artifacts recorded so far, counting repeats
+int64_t recordedArtifactCalls();
+// Writes the artifacts recorded so far to path, returning their number
+int64_t writeArchive(const std::string& path);
+
+// Makes the artifacts of the archive at path available to all TVMCompilers.
+// Returns the number of artifacts loaded.
+int64_t loadArchive(const std::string& path);
+bool findPreloadedArtifact(const std::string& key, TVMArtifact* artifact);
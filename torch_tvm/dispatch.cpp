@@ -0,0 +1,87 @@
+#include "dispatch.h"
+#include "disk_cache.h"
+
+#include <dmlc/logging.h>
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+DispatchTable& DispatchTable::get() {
+  static DispatchTable table;
+  return table;
+}
+
+void DispatchTable::setPath(const std::string& path) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  path_ = path;
+  if (path_.empty()) {
+    return;
+  }
+  std::ifstream f(path_);
+  std::string line;
+  while (std::getline(f, line)) {
+    std::istringstream is(line);
+    uint64_t hash;
+    std::string backend;
+    DispatchDecision decision;
+    if (!(is >> std::hex >> hash >> std::dec >> backend >> decision.tvm_us >>
+          decision.jit_us)) {
+      LOG(WARNING) << "Pytorch TVM: ignoring malformed dispatch table line: "
+                   << line;
+      continue;
+    }
+    std::getline(is >> std::ws, decision.ops);
+    decision.use_tvm = backend == "tvm";
+    decisions_[hash] = decision;
+  }
+}
+
+bool DispatchTable::lookup(
+    const std::string& key,
+    DispatchDecision* decision) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto it = decisions_.find(stableHash(key));
+  if (it == decisions_.end()) {
+    return false;
+  }
+  *decision = it->second;
+  return true;
+}
+
+void DispatchTable::record(
+    const std::string& key,
+    const DispatchDecision& decision) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  decisions_[stableHash(key)] = decision;
+  if (!path_.empty()) {
+    save();
+  }
+}
+
+std::vector<std::pair<uint64_t, DispatchDecision>> DispatchTable::entries() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return {decisions_.begin(), decisions_.end()};
+}
+
+// Written to a temporary file and renamed, so readers never see a partial
+// table.  Must be called with mutex_ held.
+void DispatchTable::save() {
+  auto tmp_path = path_ + ".tmp";
+  {
+    std::ofstream f(tmp_path);
+    for (const auto& kv : decisions_) {
+      f << std::hex << kv.first << std::dec << " "
+        << (kv.second.use_tvm ? "tvm" : "jit") << " " << kv.second.tvm_us
+        << " " << kv.second.jit_us << " " << kv.second.ops << "\n";
+    }
+    if (!f) {
+      LOG(WARNING) << "Pytorch TVM: cannot write dispatch table " << tmp_path;
+      return;
+    }
+  }
+  if (std::rename(tmp_path.c_str(), path_.c_str()) != 0) {
+    LOG(WARNING) << "Pytorch TVM: cannot write dispatch table " << path_;
+    std::remove(tmp_path.c_str());
+  }
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Which of the TVM kernel and the JIT interpreter runs a spec faster
+struct DispatchDecision {
+  // Best measured time of each backend, in microseconds
+  double tvm_us;
+  double jit_us;
+  bool use_tvm;
+  // Kinds of the nodes in the compilation group, for inspection
+  std::string ops;
+};
+
+// Decisions of profile guided dispatch, keyed by the stable hash of the
+// spec's disk cache key.  When a path is set, the table is loaded from it
+// and rewritten on every new decision as one line per spec:
+//   <hash> <tvm|jit> <tvm_us> <jit_us> <ops>
+struct DispatchTable {
+  static DispatchTable& get();
+
+  // Loads the decisions stored at path, which may not exist yet.  An empty
+  // path keeps decisions in memory only.
+  void setPath(const std::string& path);
+  bool lookup(const std::string& key, DispatchDecision* decision);
+  void record(const std::string& key, const DispatchDecision& decision);
+  std::vector<std::pair<uint64_t, DispatchDecision>> entries();
+
+ private:
+  void save();
+
+  std::mutex mutex_;
+  std::string path_;
+  std::unordered_map<uint64_t, DispatchDecision> decisions_;
+};
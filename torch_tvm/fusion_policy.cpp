@@ -0,0 +1,117 @@
+#include "fusion_policy.h"
+
+#include <torch/csrc/jit/passes/utils/subgraph_utils.h>
+
+#include <algorithm>
+
+static int64_t numel(const Value* value) {
+  auto type = value->type()->cast<CompleteTensorType>();
+  if (!type) {
+    return -1;
+  }
+  int64_t n = 1;
+  for (auto size : type->sizes()) {
+    n *= size;
+  }
+  return n;
+}
+
+// Multiply-accumulates per output element count as two operations
+static int64_t nodeFlops(const Node* node) {
+  if (node->outputs().size() != 1) {
+    return -1;
+  }
+  auto out = numel(node->output());
+  if (out < 0) {
+    return -1;
+  }
+  auto kind = node->kind();
+  if (kind == aten::_convolution || kind == aten::linear) {
+    // Every output element reduces over all weight elements of its channel
+    auto weight = node->input(1)->type()->cast<CompleteTensorType>();
+    if (!weight) {
+      return -1;
+    }
+    auto sizes = weight->sizes();
+    int64_t reduction = 1;
+    for (size_t i = 1; i < sizes.size(); ++i) {
+      reduction *= sizes[i];
+    }
+    return 2 * out * reduction;
+  }
+  if (kind == aten::batch_norm) {
+    return 2 * out;
+  }
+  if (kind == aten::max_pool2d || kind == aten::avg_pool2d ||
+      kind == aten::adaptive_avg_pool2d) {
+    auto in = numel(node->input(0));
+    return in < 0 ? -1 : std::max(in, out);
+  }
+  // Elementwise and data movement
+  return out;
+}
+
+int64_t estimateFlops(const Graph& subgraph) {
+  int64_t flops = 0;
+  for (const auto* node : subgraph.nodes()) {
+    if (node->kind() == prim::Constant) {
+      continue;
+    }
+    auto node_flops = nodeFlops(node);
+    if (node_flops < 0) {
+      return -1;
+    }
+    flops += node_flops;
+  }
+  return flops;
+}
+
+static bool keepGroup(
+    const std::shared_ptr<Graph>& subgraph,
+    const FusionPolicy& policy) {
+  int64_t num_nodes = 0;
+  for (const auto* node : subgraph->nodes()) {
+    if (node->kind() != prim::Constant) {
+      num_nodes++;
+    }
+  }
+  if (num_nodes < policy.min_nodes) {
+    return false;
+  }
+  if (policy.min_flops > 0) {
+    auto flops = estimateFlops(*subgraph);
+    if (flops >= 0 && flops < policy.min_flops) {
+      return false;
+    }
+  }
+  return !policy.filter || policy.filter(subgraph);
+}
+
+static void collectRejected(
+    Block* block,
+    Symbol group_kind,
+    const FusionPolicy& policy,
+    std::vector<Node*>* rejected) {
+  for (auto* node : block->nodes()) {
+    if (node->kind() == group_kind) {
+      if (!keepGroup(node->g(attr::Subgraph), policy)) {
+        rejected->push_back(node);
+      }
+      continue;
+    }
+    for (auto* sub_block : node->blocks()) {
+      collectRejected(sub_block, group_kind, policy, rejected);
+    }
+  }
+}
+
+void DissolveSmallGroups(
+    std::shared_ptr<Graph>& graph,
+    Symbol group_kind,
+    const FusionPolicy& policy) {
+  std::vector<Node*> rejected;
+  collectRejected(graph->block(), group_kind, policy, &rejected);
+  for (auto* node : rejected) {
+    SubgraphUtils::unmergeSubgraph(node);
+  }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <torch/csrc/jit/ir.h>
+
+#include <functional>
+
+using namespace torch::jit;
+
+// Decides which compilation groups are worth offloading.  Running a group
+// in TVM has a fixed cost (DLPack conversions, input binding, runtime
+// dispatch), so groups too small to amortize it are dissolved back into the
+// JIT graph.
+struct FusionPolicy {
+  // Minimum number of non-constant nodes
+  int64_t min_nodes = 1;
+  // Minimum estimated floating point operations.  Only enforced when the
+  // shapes of the group are known at fusion time.
+  int64_t min_flops = 0;
+  // Called with the subgraph of each group passing the thresholds above,
+  // returns false to dissolve it
+  std::function<bool(std::shared_ptr<Graph>)> filter;
+};
+
+// Estimated floating point operations of subgraph, or -1 if the shapes of
+// some of its values are unknown
+int64_t estimateFlops(const Graph& subgraph);
+
+// Inlines the nodes of group_kind rejected by policy back into graph
+void DissolveSmallGroups(
+    std::shared_ptr<Graph>& graph,
+    Symbol group_kind,
+    const FusionPolicy& policy);
@@ -0,0 +1,143 @@
+#include "inplace.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+using namespace torch::jit;
+
+static const Symbol inplace_inputs_attr = Symbol::attr("tvm_inplace_inputs");
+static const Symbol inplace_zero_copy_attr =
+    Symbol::attr("tvm_inplace_zero_copy");
+
+InPlaceOutputs inPlaceOutputsOf(const Node* node) {
+  InPlaceOutputs inplace;
+  if (!node->hasAttribute(inplace_inputs_attr)) {
+    return inplace;
+  }
+  inplace.inputs = node->is(inplace_inputs_attr);
+  for (auto zero_copy : node->is(inplace_zero_copy_attr)) {
+    inplace.zero_copy.push_back(zero_copy != 0);
+  }
+  return inplace;
+}
+
+// ATen's in-place variants (add_, relu_, threshold_, ...) update and return
+// their first argument
+static bool isInPlace(const Node* node) {
+  if (!node->kind().is_aten() || node->inputs().empty()) {
+    return false;
+  }
+  std::string name = node->kind().toUnqualString();
+  return name.size() > 1 && name.back() == '_' && name[name.size() - 2] != '_';
+}
+
+static void markGroup(Node* group) {
+  auto subgraph = group->g(attr::Subgraph);
+  // The input each in-place op updates, and the last update of each input
+  std::unordered_map<const Value*, Value*> root_of;
+  std::unordered_map<Value*, Node*> last_update;
+  std::vector<Value*> roots;
+  for (auto* input : subgraph->inputs()) {
+    root_of[input] = input;
+  }
+  for (auto* node : subgraph->nodes()) {
+    if (!isInPlace(node)) {
+      continue;
+    }
+    auto it = root_of.find(node->input(0));
+    if (it == root_of.end()) {
+      continue;
+    }
+    root_of[node->output()] = it->second;
+    if (!last_update.count(it->second)) {
+      roots.push_back(it->second);
+    }
+    last_update[it->second] = node;
+  }
+  if (roots.empty()) {
+    return;
+  }
+
+  std::vector<int64_t> inputs(group->outputs().size(), -1);
+  std::vector<int64_t> zero_copy(group->outputs().size(), 0);
+  for (auto* root : roots) {
+    auto* final_value = last_update.at(root)->output();
+    auto outputs = subgraph->outputs();
+    auto it = std::find(outputs.begin(), outputs.end(), final_value);
+    size_t index = it - outputs.begin();
+    if (it == outputs.end()) {
+      // Only the rest of the graph observes the update through the input,
+      // expose it so the kernel can write it back
+      subgraph->registerOutput(final_value);
+      group->addOutput()->setType(final_value->type());
+      inputs.push_back(-1);
+      zero_copy.push_back(0);
+    }
+    auto input_index =
+        std::find(subgraph->inputs().begin(), subgraph->inputs().end(), root) -
+        subgraph->inputs().begin();
+    inputs[index] = input_index;
+    // Writing into the input while other ops of the kernel still read it
+    // would corrupt them, unless the only readers are the updates
+    // themselves, which are elementwise
+    bool only_updates = true;
+    for (auto* value = root; value != final_value;) {
+      const auto& uses = value->uses();
+      only_updates &= uses.size() == 1 && isInPlace(uses[0].user) &&
+          uses[0].offset == 0;
+      if (!only_updates) {
+        break;
+      }
+      value = uses[0].user->output();
+    }
+    zero_copy[index] = only_updates;
+  }
+  group->is_(inplace_inputs_attr, inputs);
+  group->is_(inplace_zero_copy_attr, zero_copy);
+}
+
+static void markBlock(Block* block, Symbol group_kind) {
+  for (auto* node : block->nodes()) {
+    for (auto* sub_block : node->blocks()) {
+      markBlock(sub_block, group_kind);
+    }
+    if (node->kind() == group_kind) {
+      markGroup(node);
+    }
+  }
+}
+
+void MarkInPlaceOutputs(std::shared_ptr<Graph>& graph, Symbol group_kind) {
+  markBlock(graph->block(), group_kind);
+}
+
+static void separateBlock(
+    Block* block,
+    Symbol group_kind,
+    Symbol inplace_kind) {
+  for (auto it = block->nodes().begin(); it != block->nodes().end();) {
+    auto* node = *it++;
+    for (auto* sub_block : node->blocks()) {
+      separateBlock(sub_block, group_kind, inplace_kind);
+    }
+    if (node->kind() != group_kind || !inPlaceOutputsOf(node).enabled()) {
+      continue;
+    }
+    auto* group =
+        node->owningGraph()->create(inplace_kind, node->inputs(), 0);
+    group->copyAttributes(*node);
+    group->insertBefore(node);
+    for (auto* output : node->outputs()) {
+      auto* new_output = group->addOutput()->copyMetadata(output);
+      output->replaceAllUsesWith(new_output);
+    }
+    node->destroy();
+  }
+}
+
+void SeparateInPlaceGroups(
+    std::shared_ptr<Graph>& graph,
+    Symbol group_kind,
+    Symbol inplace_kind) {
+  separateBlock(graph->block(), group_kind, inplace_kind);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <torch/csrc/jit/ir.h>
+
+#include <algorithm>
+#include <vector>
+
+// Outputs of a compilation group that are in-place updates of one of its
+// inputs, e.g. the result of `x.add_(y)` where x is an input of the group.
+// Such outputs end up in the input's storage.
+struct InPlaceOutputs {
+  // Input updated by each output, -1 for outputs that are fresh tensors
+  std::vector<int64_t> inputs;
+  // Whether the kernel may bind the input's storage as the output, which
+  // needs set_output_zero_copy in the graph runtime.  Otherwise, or when the
+  // group reads the input other than through the in-place op, the result is
+  // copied into the input after the kernel.
+  std::vector<bool> zero_copy;
+
+  bool enabled() const {
+    return !inputs.empty();
+  }
+  int64_t inputOf(size_t output) const {
+    return output < inputs.size() ? inputs[output] : -1;
+  }
+  bool updates(int64_t input) const {
+    return std::find(inputs.begin(), inputs.end(), input) != inputs.end();
+  }
+};
+
+// Node attributes set by MarkInPlaceOutputs on tvm::CompilationGroups
+InPlaceOutputs inPlaceOutputsOf(const torch::jit::Node* node);
+
+// Finds the in-place ops of each compilation group mutating an input of the
+// group.  The final value of each mutated input becomes an output of the
+// group (added if needed) and is marked with the input it updates, so the
+// group keeps the mutation visible to the rest of the graph.
+void MarkInPlaceOutputs(
+    std::shared_ptr<torch::jit::Graph>& graph,
+    torch::jit::Symbol group_kind);
+
+// Replaces the groups marked by MarkInPlaceOutputs with nodes of
+// inplace_kind, an operator registered with conservative alias analysis.
+// Groups of group_kind are pure, so a group whose update is only read
+// through the input after it would otherwise be removed or reordered.  Run
+// last, as the other passes look for group_kind.
+void SeparateInPlaceGroups(
+    std::shared_ptr<torch::jit::Graph>& graph,
+    torch::jit::Symbol group_kind,
+    torch::jit::Symbol inplace_kind);
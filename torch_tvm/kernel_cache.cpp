@@ -0,0 +1,225 @@
+#include "kernel_cache.h"
+#include "allocator.h"
+#include "compiler.h"
+
+#include <dmlc/json.h>
+#include <tvm/runtime/packed_func.h>
+
+#include <algorithm>
+#include <sstream>
+
+// Reads the value of a ["list_<type>", [...]] entry of the graph attrs
+template <typename T>
+static void readGraphAttr(
+    const std::string& graph_json,
+    const std::string& key,
+    std::vector<T>* values) {
+  auto pos = graph_json.find("\"" + key + "\"");
+  CHECK(pos != std::string::npos) << "Missing graph attr " << key;
+  pos = graph_json.find(':', pos);
+  CHECK(pos != std::string::npos);
+  std::istringstream is(graph_json.substr(pos + 1));
+  dmlc::JSONReader reader(&is);
+  std::string type;
+  reader.BeginArray();
+  CHECK(reader.NextArrayItem());
+  reader.Read(&type);
+  CHECK(reader.NextArrayItem());
+  reader.Read(values);
+  CHECK(!reader.NextArrayItem());
+}
+
+bool readGraphArray(
+    const std::string& graph_json,
+    const std::string& key,
+    std::vector<int64_t>* values) {
+  auto pos = graph_json.find("\"" + key + "\"");
+  if (pos == std::string::npos) {
+    return false;
+  }
+  pos = graph_json.find(':', pos);
+  std::istringstream is(graph_json.substr(pos + 1));
+  dmlc::JSONReader reader(&is);
+  try {
+    reader.Read(values);
+  } catch (const std::exception& e) {
+    return false;
+  }
+  return true;
+}
+
+// Mirrors the storage planning of GraphRuntime::SetupStorage
+bool graphStoragePool(
+    const std::string& graph_json,
+    std::vector<int>* entry_storage_ids,
+    std::vector<int64_t>* pool_bytes) {
+  std::vector<int> storage_ids;
+  std::vector<std::vector<int64_t>> shapes;
+  std::vector<std::string> dtypes;
+  try {
+    readGraphAttr(graph_json, "storage_id", &storage_ids);
+    readGraphAttr(graph_json, "shape", &shapes);
+    readGraphAttr(graph_json, "dltype", &dtypes);
+  } catch (const std::exception& e) {
+    LOG(WARNING) << "Pytorch TVM: cannot determine storage size of graph, "
+                 << "exception: " << e.what() << "\n";
+    return false;
+  }
+  if (storage_ids.size() != shapes.size() ||
+      storage_ids.size() != dtypes.size()) {
+    return false;
+  }
+  pool_bytes->clear();
+  for (size_t i = 0; i < storage_ids.size(); ++i) {
+    auto type = tvm::runtime::String2TVMType(dtypes[i]);
+    int64_t bytes = (type.bits * type.lanes + 7) / 8;
+    for (auto dim : shapes[i]) {
+      bytes *= dim;
+    }
+    size_t sid = storage_ids[i];
+    if (sid >= pool_bytes->size()) {
+      pool_bytes->resize(sid + 1, 0);
+    }
+    (*pool_bytes)[sid] = std::max((*pool_bytes)[sid], bytes);
+  }
+  // Pool entries are allocated as float32 arrays
+  for (auto& bytes : *pool_bytes) {
+    bytes = (bytes + 3) / 4 * 4;
+  }
+  *entry_storage_ids = std::move(storage_ids);
+  return true;
+}
+
+int64_t graphStorageBytes(const std::string& graph_json) {
+  std::vector<int> storage_ids;
+  std::vector<int64_t> pool_bytes;
+  if (!graphStoragePool(graph_json, &storage_ids, &pool_bytes)) {
+    return 0;
+  }
+  int64_t total = 0;
+  for (auto bytes : pool_bytes) {
+    total += bytes;
+  }
+  return total;
+}
+
+KernelCacheManager& KernelCacheManager::get() {
+  static KernelCacheManager manager;
+  return manager;
+}
+
+void KernelCacheManager::setBudget(int64_t bytes) {
+  budget_ = std::max<int64_t>(bytes, 0);
+}
+
+KernelCacheStats KernelCacheManager::stats() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  KernelCacheStats stats;
+  stats.budget = budget_;
+  stats.bytes = bytes_;
+  stats.evictions = evictions_;
+  std::unordered_map<int64_t, size_t> group_index;
+  for (const auto& kv : records_) {
+    const auto& record = kv.second;
+    if (record.evicted) {
+      continue;
+    }
+    auto it = group_index.find(record.group_id);
+    if (it == group_index.end()) {
+      KernelCacheGroupStats group;
+      group.id = record.group_id;
+      auto compiler = record.compiler.lock();
+      group.ops = compiler ? compiler->groupOps() : "";
+      group.bytes = 0;
+      group.kernels = 0;
+      group.evictions = group_evictions_[record.group_id];
+      it = group_index.emplace(record.group_id, stats.groups.size()).first;
+      stats.groups.emplace_back(std::move(group));
+    }
+    auto& group = stats.groups[it->second];
+    group.bytes += record.bytes;
+    group.kernels++;
+  }
+  return stats;
+}
+
+void KernelCacheManager::track(
+    const std::shared_ptr<TVMCompiler>& compiler,
+    const std::shared_ptr<TVMCacheEntry>& entry,
+    TVMObject* obj,
+    int64_t bytes) {
+  // A kernel about to be installed is the most recently used, otherwise it
+  // would be the first evicted, before it ever runs
+  obj->markUsed();
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto& record = records_[obj];
+  record.compiler = compiler;
+  record.entry = entry;
+  record.group_id = compiler->groupId();
+  record.evicted = false;
+  record.bytes = bytes;
+  bytes_ += bytes;
+}
+
+void KernelCacheManager::addBytes(TVMObject* obj, int64_t bytes) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto it = records_.find(obj);
+  if (it == records_.end() || it->second.evicted) {
+    return;
+  }
+  it->second.bytes += bytes;
+  bytes_ += bytes;
+}
+
+void KernelCacheManager::untrack(TVMObject* obj) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto it = records_.find(obj);
+  if (it == records_.end()) {
+    return;
+  }
+  if (!it->second.evicted) {
+    bytes_ -= it->second.bytes;
+  }
+  records_.erase(it);
+}
+
+void KernelCacheManager::enforceBudget() {
+  auto budget = budget_.load(std::memory_order_relaxed);
+  if (budget == 0 || bytes_.load(std::memory_order_relaxed) <= budget) {
+    return;
+  }
+  std::vector<std::pair<std::weak_ptr<TVMCompiler>, std::weak_ptr<TVMCacheEntry>>>
+      victims;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    std::vector<std::pair<int64_t, TVMObject*>> lru;
+    for (const auto& kv : records_) {
+      if (!kv.second.evicted) {
+        lru.emplace_back(kv.first->last_used.load(), kv.first);
+      }
+    }
+    std::sort(lru.begin(), lru.end());
+    // The most recently used kernel is always kept, evicting it would only
+    // cause it to be recompiled on the next call
+    for (size_t i = 0; i + 1 < lru.size() && bytes_ > budget_; ++i) {
+      auto& record = records_[lru[i].second];
+      record.evicted = true;
+      bytes_ -= record.bytes;
+      evictions_++;
+      group_evictions_[record.group_id]++;
+      victims.emplace_back(record.compiler, record.entry);
+    }
+  }
+  for (const auto& victim : victims) {
+    auto compiler = victim.first.lock();
+    auto entry = victim.second.lock();
+    if (compiler && entry) {
+      compiler->evict(entry);
+    }
+  }
+  // The storage of the evicted runtimes went back to the arena, which would
+  // otherwise keep it from the c10 allocator
+  if (!victims.empty()) {
+    CPUArena::get().emptyCache();
+  }
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct TVMCompiler;
+struct TVMCacheEntry;
+struct TVMObject;
+
+// Bytes of intermediate storage a GraphRuntime allocates for graph_json,
+// or 0 if the graph cannot be parsed
+int64_t graphStorageBytes(const std::string& graph_json);
+// The storage id of each node entry of graph_json and the bytes of each
+// storage pool entry, which a GraphRuntime allocates in storage id order.
+// Returns false if the graph cannot be parsed.
+bool graphStoragePool(
+    const std::string& graph_json,
+    std::vector<int>* entry_storage_ids,
+    std::vector<int64_t>* pool_bytes);
+// Reads a top level integer array of graph_json, e.g. arg_nodes
+bool readGraphArray(
+    const std::string& graph_json,
+    const std::string& key,
+    std::vector<int64_t>* values);
+
+struct KernelCacheGroupStats {
+  int64_t id;
+  // Kinds of the nodes in the compilation group
+  std::string ops;
+  int64_t bytes;
+  int64_t kernels;
+  int64_t evictions;
+};
+
+struct KernelCacheStats {
+  // 0 if unbounded
+  int64_t budget;
+  int64_t bytes;
+  int64_t evictions;
+  std::vector<KernelCacheGroupStats> groups;
+};
+
+// Byte accounting of the compiled kernels of all TVMCompilers.  Once the
+// budget is exceeded, the least recently used kernels are evicted from
+// their compiler's cache; they are recompiled (or reloaded from the disk
+// cache) on their next use.
+struct KernelCacheManager {
+  static KernelCacheManager& get();
+
+  void setBudget(int64_t bytes);
+  KernelCacheStats stats();
+
+  // Starts accounting for the bytes held by obj, cached in entry of
+  // compiler.  Must be called before obj is visible to other threads.
+  void track(
+      const std::shared_ptr<TVMCompiler>& compiler,
+      const std::shared_ptr<TVMCacheEntry>& entry,
+      TVMObject* obj,
+      int64_t bytes);
+  void addBytes(TVMObject* obj, int64_t bytes);
+  // Called when obj is destroyed
+  void untrack(TVMObject* obj);
+  // Evicts kernels until the budget is met.  Must not be called with a
+  // TVMCompiler's cache lock held.
+  void enforceBudget();
+
+ private:
+  struct Record {
+    std::weak_ptr<TVMCompiler> compiler;
+    std::weak_ptr<TVMCacheEntry> entry;
+    int64_t group_id;
+    int64_t bytes;
+    bool evicted;
+  };
+
+  std::mutex mutex_;
+  std::unordered_map<TVMObject*, Record> records_;
+  std::unordered_map<int64_t, int64_t> group_evictions_;
+  // Read without the lock on the hot path of enforceBudget
+  std::atomic<int64_t> budget_{0};
+  std::atomic<int64_t> bytes_{0};
+  int64_t evictions_ = 0;
+};
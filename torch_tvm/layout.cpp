@@ -0,0 +1,126 @@
+#include "layout.h"
+#include "inplace.h"
+
+#include <tvm/relay/attrs/transform.h>
+#include <tvm/relay/op.h>
+
+#include <algorithm>
+
+using namespace torch::jit;
+
+static const Symbol blocked_inputs_attr = Symbol::attr("tvm_blocked_inputs");
+static const Symbol blocked_outputs_attr =
+    Symbol::attr("tvm_blocked_outputs");
+static const Symbol layout_block_attr = Symbol::attr("tvm_layout_block");
+
+static std::vector<bool> indexMask(
+    const Node* node,
+    Symbol attr,
+    size_t size) {
+  std::vector<bool> mask(size, false);
+  if (node->hasAttribute(attr)) {
+    for (auto index : node->is(attr)) {
+      mask.at(index) = true;
+    }
+  }
+  return mask;
+}
+
+BlockedLayout blockedLayoutOf(const Node* node) {
+  BlockedLayout layout;
+  if (!node->hasAttribute(layout_block_attr)) {
+    return layout;
+  }
+  layout.block = node->i(layout_block_attr);
+  layout.inputs =
+      indexMask(node, blocked_inputs_attr, node->inputs().size());
+  layout.outputs =
+      indexMask(node, blocked_outputs_attr, node->outputs().size());
+  return layout;
+}
+
+static void addIndex(Node* node, Symbol attr, int64_t index) {
+  std::vector<int64_t> indices;
+  if (node->hasAttribute(attr)) {
+    indices = node->is(attr);
+  }
+  if (std::find(indices.begin(), indices.end(), index) == indices.end()) {
+    indices.push_back(index);
+  }
+  node->is_(attr, indices);
+}
+
+static void markBlock(
+    Block* block,
+    Symbol group_kind,
+    int64_t layout_block) {
+  for (auto* node : block->nodes()) {
+    for (auto* sub_block : node->blocks()) {
+      markBlock(sub_block, group_kind, layout_block);
+    }
+    if (node->kind() != group_kind) {
+      continue;
+    }
+    // Tensors updated in place keep the layout the rest of the graph sees
+    auto inplace = inPlaceOutputsOf(node);
+    for (size_t i = 0; i < node->outputs().size(); ++i) {
+      if (inplace.inputOf(i) >= 0) {
+        continue;
+      }
+      const auto& uses = node->outputs()[i]->uses();
+      bool only_groups = !uses.empty() &&
+          std::all_of(uses.begin(), uses.end(), [&](const Use& use) {
+                           return use.user->kind() == group_kind &&
+                               !inPlaceOutputsOf(use.user).updates(use.offset);
+                         });
+      if (!only_groups) {
+        continue;
+      }
+      addIndex(node, blocked_outputs_attr, i);
+      node->i_(layout_block_attr, layout_block);
+      for (const auto& use : uses) {
+        addIndex(use.user, blocked_inputs_attr, use.offset);
+        use.user->i_(layout_block_attr, layout_block);
+      }
+    }
+  }
+}
+
+void MarkBlockedLayout(
+    std::shared_ptr<Graph>& graph,
+    Symbol group_kind,
+    int64_t block) {
+  markBlock(graph->block(), group_kind, block);
+}
+
+std::string blockedLayoutName(int64_t block) {
+  return "NCHW" + std::to_string(block) + "c";
+}
+
+std::vector<int64_t> unblockedShape(at::IntArrayRef blocked_shape) {
+  AT_ASSERT(blocked_shape.size() == 5);
+  return {blocked_shape[0],
+          blocked_shape[1] * blocked_shape[4],
+          blocked_shape[2],
+          blocked_shape[3]};
+}
+
+at::Tensor unblock(const at::Tensor& tensor) {
+  // [N, C / b, H, W, b] -> [N, C / b, b, H, W] -> [N, C, H, W]
+  return tensor.permute({0, 1, 4, 2, 3})
+      .reshape(unblockedShape(tensor.sizes()));
+}
+
+tvm::relay::Expr layoutTransform(
+    tvm::relay::Expr data,
+    const std::string& src_layout,
+    const std::string& dst_layout) {
+  auto attrs = tvm::make_node<tvm::relay::LayoutTransformAttrs>();
+  attrs->src_layout = src_layout;
+  attrs->dst_layout = dst_layout;
+  return tvm::relay::CallNode::make(
+      tvm::relay::Op::Get("layout_transform"),
+      {data},
+      tvm::Attrs(attrs),
+      {});
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <ATen/ATen.h>
+#include <torch/csrc/jit/ir.h>
+#include <tvm/relay/expr.h>
+
+#include <string>
+#include <vector>
+
+// Activations passed between adjacent compilation groups in the blocked
+// NCHW[block]c layout, i.e. with shape [N, C / block, H, W, block], sparing
+// a layout transform on each side of the boundary.
+struct BlockedLayout {
+  int64_t block = 0;
+  // Inputs that may arrive blocked and outputs to emit blocked, by index
+  std::vector<bool> inputs;
+  std::vector<bool> outputs;
+
+  bool enabled() const {
+    return block > 0;
+  }
+};
+
+// Node attributes set by MarkBlockedLayout on tvm::CompilationGroups
+BlockedLayout blockedLayoutOf(const torch::jit::Node* node);
+
+// Marks the values produced by one compilation group and consumed only by
+// other compilation groups to be passed in the blocked layout.  Must run
+// after MarkInPlaceOutputs, values updated in place are never blocked.  Whether a
+// value is actually blocked is decided when its producer is compiled: only
+// 4-d outputs whose channels divide evenly are, and consumers detect them
+// by their rank.
+void MarkBlockedLayout(
+    std::shared_ptr<torch::jit::Graph>& graph,
+    torch::jit::Symbol group_kind,
+    int64_t block);
+
+std::string blockedLayoutName(int64_t block);
+// Shape of a blocked tensor in NCHW
+std::vector<int64_t> unblockedShape(at::IntArrayRef blocked_shape);
+// Converts a blocked tensor back to a contiguous NCHW tensor
+at::Tensor unblock(const at::Tensor& tensor);
+
+tvm::relay::Expr layoutTransform(
+    tvm::relay::Expr data,
+    const std::string& src_layout,
+    const std::string& dst_layout);
@@ -0,0 +1,81 @@
+#include "mixed_precision.h"
+
+#include <c10/util/Exception.h>
+#include <tvm/relay/attrs/nn.h>
+#include <tvm/relay/attrs/transform.h>
+#include <tvm/relay/expr_functor.h>
+#include <tvm/relay/module.h>
+#include <tvm/relay/transform.h>
+
+using namespace tvm::relay;
+
+void checkPrecision(const std::string& precision) {
+  // bfloat16 has no TVM equivalent yet
+  TORCH_CHECK(
+      precision == "fp32" || precision == "fp16",
+      "precision must be \"fp32\" or \"fp16\", got ",
+      precision);
+}
+
+namespace {
+
+class MixedPrecisionMutator : public ExprMutator {
+ public:
+  explicit MixedPrecisionMutator(::tvm::Type compute_type)
+      : compute_type_(compute_type) {}
+
+  Expr VisitExpr_(const CallNode* call) final {
+    auto expr = ExprMutator::VisitExpr_(call);
+    const auto* type = call->checked_type().as<TensorTypeNode>();
+    if (!type || type->dtype != ::tvm::Float(32)) {
+      return expr;
+    }
+    const auto* new_call = expr.as<CallNode>();
+    if (call->op.same_as(conv2d_op_)) {
+      auto attrs =
+          tvm::make_node<Conv2DAttrs>(*call->attrs.as<Conv2DAttrs>());
+      attrs->out_dtype = ::tvm::Float(32);
+      return CallNode::make(
+          call->op,
+          {cast(new_call->args[0]), cast(new_call->args[1])},
+          tvm::Attrs(attrs),
+          {});
+    }
+    if (call->op.same_as(dense_op_)) {
+      auto attrs = tvm::make_node<DenseAttrs>(*call->attrs.as<DenseAttrs>());
+      attrs->out_dtype = ::tvm::Float(32);
+      return CallNode::make(
+          call->op,
+          {cast(new_call->args[0]), cast(new_call->args[1])},
+          tvm::Attrs(attrs),
+          {});
+    }
+    return expr;
+  }
+
+ private:
+  Expr cast(Expr expr) {
+    auto attrs = tvm::make_node<CastAttrs>();
+    attrs->dtype = compute_type_;
+    return CallNode::make(cast_op_, {expr}, tvm::Attrs(attrs), {});
+  }
+
+  ::tvm::Type compute_type_;
+  const Op& conv2d_op_ = Op::Get("nn.conv2d");
+  const Op& dense_op_ = Op::Get("nn.dense");
+  const Op& cast_op_ = Op::Get("cast");
+};
+
+} // namespace
+
+Function toMixedPrecision(Function func, const std::string& precision) {
+  checkPrecision(precision);
+  if (precision == "fp32") {
+    return func;
+  }
+  // The rewrite only applies to float32 calls, which requires their types
+  auto mod = transform::InferType()(ModuleNode::FromExpr(func));
+  auto typed_func = tvm::Downcast<Function>(mod->Lookup("main"));
+  return tvm::Downcast<Function>(
+      MixedPrecisionMutator(::tvm::Float(16)).Mutate(typed_func));
+}
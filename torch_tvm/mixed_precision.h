@@ -0,0 +1,19 @@
+#pragma once
+
+#include <tvm/relay/expr.h>
+
+#include <string>
+
+// Validates a precision accepted by torch_tvm.enable: "fp32" leaves
+// functions untouched, "fp16" runs convolutions and dense layers in half
+// precision
+void checkPrecision(const std::string& precision);
+
+// Rewrites the float32 convolutions and dense layers of func to read their
+// inputs in precision, accumulating and producing float32.  All other
+// operators, including the numerically sensitive batch_norm and softmax,
+// keep computing in float32.  Casts of constant weights are folded at build
+// time, so the kernels read half the weight bytes.
+tvm::relay::Function toMixedPrecision(
+    tvm::relay::Function func,
+    const std::string& precision);
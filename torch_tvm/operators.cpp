@@ -193,6 +193,12 @@ RegisterTVMOperator reg({
          auto shape = w_t->shape;
          tvm::Array<tvm::relay::IndexExpr> w_sizes = {shape[2], shape[3]};
          conv_attrs->kernel_size = w_sizes;
+       } else if (
+           const tvm::relay::ConstantNode* c =
+               inputs[1].as<tvm::relay::ConstantNode>()) {
+         auto shape = c->tensor_type()->shape;
+         tvm::Array<tvm::relay::IndexExpr> w_sizes = {shape[2], shape[3]};
+         conv_attrs->kernel_size = w_sizes;
        }
 
        conv_attrs->strides = relayToArray<tvm::relay::IndexExpr>(inputs[3]);
@@ -202,11 +208,8 @@ RegisterTVMOperator reg({
        auto out = tvm::relay::CallNode::make(
            op, new_inputs, tvm::Attrs(conv_attrs), {});
 
-       // Check if bias node is a var or constant (denoting a None currently),
-       // if bias is present, emit an additional bias_add node.
-       // TODO: better check when relay has None type
-       auto bias_is_none = inputs[2].as<tvm::relay::ConstantNode>();
-       if (!bias_is_none) {
+       // If bias is present, emit an additional bias_add node.
+       if (!relayIsNone(inputs[2])) {
          auto bias_add_op = tvm::relay::Op::Get("nn.bias_add");
          auto bias_add_attrs = tvm::make_node<tvm::relay::BiasAddAttrs>();
          bias_add_attrs->axis = 1;
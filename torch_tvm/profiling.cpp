@@ -0,0 +1,252 @@
+#include "profiling.h"
+
+#include <dmlc/json.h>
+#include <tvm/relay/op.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <tuple>
+#include <unordered_set>
+
+static std::atomic<bool> profile_ops{false};
+
+void setProfileOps(bool enabled) {
+  profile_ops = enabled;
+}
+
+bool profileOps() {
+  return profile_ops.load(std::memory_order_relaxed);
+}
+
+static std::string sourceOf(const torch::jit::Node* node) {
+  auto scope = node->scopeName();
+  if (!scope.empty()) {
+    return scope;
+  }
+  auto location = node->sourceRange().file_line_col();
+  if (!location) {
+    return "";
+  }
+  std::ostringstream os;
+  os << std::get<0>(*location) << ":" << std::get<1>(*location);
+  return os.str();
+}
+
+// Post-order, so operators are listed before their users
+static void collectOps(
+    const tvm::relay::Expr& expr,
+    std::unordered_set<const tvm::Node*>* visited,
+    std::vector<std::string>* ops) {
+  if (!visited->insert(expr.get()).second) {
+    return;
+  }
+  if (auto call = expr.as<tvm::relay::CallNode>()) {
+    for (const auto& arg : call->args) {
+      collectOps(arg, visited, ops);
+    }
+    if (auto op = call->op.as<tvm::relay::OpNode>()) {
+      ops->push_back(op->name);
+    }
+  } else if (auto tuple = expr.as<tvm::relay::TupleNode>()) {
+    for (const auto& field : tuple->fields) {
+      collectOps(field, visited, ops);
+    }
+  } else if (auto item = expr.as<tvm::relay::TupleGetItemNode>()) {
+    collectOps(item->tuple, visited, ops);
+  }
+}
+
+NodeOps nodeOpsOf(
+    const torch::jit::Node* node,
+    const tvm::relay::Expr& expr,
+    const tvm::Array<tvm::relay::Expr>& inputs) {
+  NodeOps node_ops;
+  node_ops.kind = node->kind().toQualString();
+  node_ops.source = sourceOf(node);
+  std::unordered_set<const tvm::Node*> visited;
+  for (const auto& input : inputs) {
+    visited.insert(input.get());
+  }
+  collectOps(expr, &visited, &node_ops.ops);
+  return node_ops;
+}
+
+namespace {
+
+// A node of the graph json of a GraphRuntime
+struct GraphNode {
+  std::string op;
+  std::string name;
+  std::map<std::string, std::string> attrs;
+  std::vector<std::vector<int64_t>> inputs;
+  std::vector<int64_t> control_deps;
+
+  void Load(dmlc::JSONReader* reader) {
+    dmlc::JSONObjectReadHelper helper;
+    helper.DeclareField("op", &op);
+    helper.DeclareField("name", &name);
+    helper.DeclareOptionalField("attrs", &attrs);
+    helper.DeclareOptionalField("inputs", &inputs);
+    helper.DeclareOptionalField("control_deps", &control_deps);
+    helper.ReadAllFields(reader);
+  }
+};
+
+} // namespace
+
+static bool readGraphNodes(
+    const std::string& graph_json,
+    std::vector<GraphNode>* nodes) {
+  auto pos = graph_json.find("\"nodes\"");
+  if (pos == std::string::npos) {
+    return false;
+  }
+  pos = graph_json.find(':', pos);
+  std::istringstream is(graph_json.substr(pos + 1));
+  dmlc::JSONReader reader(&is);
+  try {
+    reader.Read(nodes);
+  } catch (const std::exception& e) {
+    LOG(WARNING) << "Pytorch TVM: cannot read the kernels of graph, "
+                 << "exception: " << e.what() << "\n";
+    return false;
+  }
+  return true;
+}
+
+static void appendUnique(std::string* list, const std::string& item) {
+  if (item.empty()) {
+    return;
+  }
+  std::string delimited = ", " + *list + ", ";
+  if (delimited.find(", " + item + ", ") != std::string::npos) {
+    return;
+  }
+  if (!list->empty()) {
+    *list += ", ";
+  }
+  *list += item;
+}
+
+std::vector<KernelProfile> attributeKernels(
+    const std::string& graph_json,
+    const std::vector<NodeOps>& node_ops) {
+  std::vector<GraphNode> graph_nodes;
+  if (!readGraphNodes(graph_json, &graph_nodes)) {
+    return {};
+  }
+  std::vector<KernelProfile> kernels;
+  for (size_t i = 0; i < graph_nodes.size(); ++i) {
+    const auto& node = graph_nodes[i];
+    if (node.op == "null") {
+      continue;
+    }
+    KernelProfile kernel;
+    kernel.node = i;
+    auto func_name = node.attrs.find("func_name");
+    kernel.kernel =
+        func_name != node.attrs.end() ? func_name->second : node.name;
+    kernels.push_back(std::move(kernel));
+  }
+
+  // Fused functions are named after the operators they run, e.g. nn.conv2d
+  // and nn.relu fuse into fused_nn_conv2d_nn_relu.  Operators TVM rewrote
+  // away (e.g. nn.batch_norm, folded by SimplifyInference) appear in no
+  // kernel and are skipped.
+  std::vector<std::pair<size_t, std::string>> ops;
+  for (size_t i = 0; i < node_ops.size(); ++i) {
+    for (auto op : node_ops[i].ops) {
+      std::replace(op.begin(), op.end(), '.', '_');
+      bool fused = std::any_of(
+          kernels.begin(), kernels.end(), [&](const KernelProfile& k) {
+            return k.kernel.find(op) != std::string::npos;
+          });
+      if (fused) {
+        ops.emplace_back(i, std::move(op));
+      }
+    }
+  }
+
+  // Kernels run in topological order, as do the nodes, so each kernel
+  // consumes the operators found in its name from where the previous one
+  // stopped.  Nodes without a fused operator go with the next node that has
+  // one.
+  size_t next_op = 0;
+  size_t next_node = 0;
+  for (auto& kernel : kernels) {
+    size_t cursor = 0;
+    auto attribute = [&](size_t i) {
+      appendUnique(&kernel.nodes, node_ops[i].kind);
+      appendUnique(&kernel.source, node_ops[i].source);
+    };
+    while (next_op < ops.size()) {
+      auto pos = kernel.kernel.find(ops[next_op].second, cursor);
+      if (pos == std::string::npos) {
+        break;
+      }
+      cursor = pos + ops[next_op].second.size();
+      auto node = ops[next_op].first;
+      for (; next_node <= node; ++next_node) {
+        attribute(next_node);
+      }
+      // Operators of a node split over several kernels
+      attribute(node);
+      ++next_op;
+    }
+  }
+  return kernels;
+}
+
+// Enough for the events of a profiled run of most models
+static constexpr size_t kMaxKernelTimes = 1 << 16;
+
+static std::mutex kernel_times_mutex;
+static std::map<int64_t, std::vector<KernelProfile>> kernel_times;
+static int64_t next_kernel_times_id = 0;
+
+int64_t recordKernelTimes(
+    const std::vector<KernelProfile>& kernels,
+    const std::string& times) {
+  // A trailing comma separated list of the time of each node
+  std::vector<double> node_us;
+  std::istringstream is(times);
+  std::string time;
+  while (std::getline(is, time, ',')) {
+    node_us.push_back(time.empty() ? 0 : std::stod(time));
+  }
+  auto record = kernels;
+  for (auto& kernel : record) {
+    if (static_cast<size_t>(kernel.node) < node_us.size()) {
+      kernel.us = node_us[kernel.node];
+    }
+  }
+
+  std::lock_guard<std::mutex> guard(kernel_times_mutex);
+  auto id = next_kernel_times_id++;
+  kernel_times.emplace(id, std::move(record));
+  if (kernel_times.size() > kMaxKernelTimes) {
+    kernel_times.erase(kernel_times.begin());
+  }
+  return id;
+}
+
+std::vector<KernelProfile> kernelTimes(int64_t id) {
+  std::lock_guard<std::mutex> guard(kernel_times_mutex);
+  auto it = kernel_times.find(id);
+  if (it == kernel_times.end()) {
+    return {};
+  }
+  return it->second;
+}
+
+void clearKernelTimes() {
+  std::lock_guard<std::mutex> guard(kernel_times_mutex);
+  kernel_times.clear();
+}
+
+std::string kernelTimesMarker(int64_t id) {
+  return "TVM::kernels#" + std::to_string(id);
+}
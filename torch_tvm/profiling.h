@@ -0,0 +1,61 @@
+#pragma once
+
+#include <torch/csrc/jit/ir.h>
+#include <tvm/relay/expr.h>
+
+#include <string>
+#include <vector>
+
+// Per operator profiling.  With profile_ops enabled, runtimes are created by
+// TVM's debug graph runtime, which times each fused kernel it runs.  Kernels
+// are attributed to the JIT nodes they were generated from, and
+// torch_tvm.profile expands the timings into nested autograd profiler
+// events.
+void setProfileOps(bool enabled);
+bool profileOps();
+
+// The Relay operators a node of a subgraph was converted to
+struct NodeOps {
+  std::string kind;
+  // Module scope or source location of the node, may be empty
+  std::string source;
+  // In the order they run
+  std::vector<std::string> ops;
+};
+
+// The operators of expr, the conversion of node, that are not part of the
+// expressions of its inputs
+NodeOps nodeOpsOf(
+    const torch::jit::Node* node,
+    const tvm::relay::Expr& expr,
+    const tvm::Array<tvm::relay::Expr>& inputs);
+
+struct KernelProfile {
+  // Index of the kernel among the nodes of the graph
+  int64_t node = 0;
+  // Name of the fused function, e.g. fused_nn_conv2d_add_nn_relu
+  std::string kernel;
+  // Kinds and sources of the JIT nodes the kernel runs, comma separated
+  std::string nodes;
+  std::string source;
+  double us = 0;
+};
+
+// One profile per kernel node of graph_json in execution order, attributed
+// to node_ops (in topological order) by the operator names fused into the
+// kernel names.  Kernels whose operators were introduced by TVM (e.g. layout
+// transforms) are attributed to no node.
+std::vector<KernelProfile> attributeKernels(
+    const std::string& graph_json,
+    const std::vector<NodeOps>& node_ops);
+
+// Stores the times in microseconds returned by the debug runtime's
+// run_individual for the kernels of a graph, returning an id for
+// kernelTimes.  Only the most recent records are kept.
+int64_t recordKernelTimes(
+    const std::vector<KernelProfile>& kernels,
+    const std::string& times);
+std::vector<KernelProfile> kernelTimes(int64_t id);
+void clearKernelTimes();
+// Name of the autograd profiler event marking where the record ran
+std::string kernelTimesMarker(int64_t id);
@@ -0,0 +1,353 @@
+#include "quantization.h"
+#include "compiler.h"
+#include "operators.h"
+
+#include <torch/csrc/jit/constants.h>
+#include <torch/csrc/jit/operator.h>
+#include <tvm/relay/attrs/nn.h>
+#include <tvm/relay/attrs/transform.h>
+#include <tvm/relay/module.h>
+#include <tvm/relay/qnn/attrs.h>
+#include <tvm/relay/transform.h>
+
+using namespace torch::jit;
+
+static const auto quantize_sym =
+    Symbol::fromQualString("aten::quantize_linear");
+static const auto q_add_sym = Symbol::fromQualString("quantized::add");
+static const auto q_relu_sym = Symbol::fromQualString("quantized::relu");
+// Prepacked weight operators and the operators unpacking their weight.  The
+// fbgemm_ names were dropped by later PyTorch releases.
+static const std::unordered_map<Symbol, Symbol> unpack_ops = {
+    {Symbol::fromQualString("quantized::linear"),
+     Symbol::fromQualString("quantized::linear_unpack")},
+    {Symbol::fromQualString("quantized::fbgemm_linear"),
+     Symbol::fromQualString("quantized::fbgemm_linear_unpack")},
+    {Symbol::fromQualString("quantized::conv2d"),
+     Symbol::fromQualString("quantized::conv_unpack")},
+    {Symbol::fromQualString("quantized::fbgemm_conv2d"),
+     Symbol::fromQualString("quantized::fbgemm_conv_unpack")},
+};
+
+static QParams qparamsOfTensor(const at::Tensor& tensor) {
+  QParams qparams;
+  if (tensor.is_quantized()) {
+    qparams.scale = tensor.q_scale();
+    qparams.zero_point = tensor.q_zero_point();
+    qparams.dtype = tensor.scalar_type();
+  }
+  return qparams;
+}
+
+std::vector<QParams> qparamsOf(at::ArrayRef<IValue> tensors) {
+  std::vector<QParams> qparams;
+  for (const auto& tensor : tensors) {
+    qparams.emplace_back(qparamsOfTensor(tensor.toTensor()));
+  }
+  return qparams;
+}
+
+QParamsMap inferQParams(const Graph& subgraph, at::ArrayRef<IValue> inputs) {
+  QParamsMap qparams;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    auto input_qparams = qparamsOfTensor(inputs[i].toTensor());
+    if (input_qparams.quantized()) {
+      qparams[subgraph.inputs()[i]] = input_qparams;
+    }
+  }
+  auto input_dtype = [&](const Value* value) {
+    auto it = qparams.find(value);
+    return it == qparams.end() ? at::kQUInt8 : it->second.dtype;
+  };
+  for (const auto* node : subgraph.nodes()) {
+    auto kind = node->kind();
+    if (kind == q_relu_sym) {
+      auto it = qparams.find(node->input(0));
+      if (it != qparams.end()) {
+        qparams[node->output()] = it->second;
+      }
+      continue;
+    }
+    // Operators whose output parameters are their last two (or, for
+    // quantize_linear, their second and third) arguments
+    size_t scale_index;
+    if (kind == quantize_sym) {
+      scale_index = 1;
+    } else if (kind == q_add_sym || unpack_ops.count(kind)) {
+      scale_index = node->inputs().size() - 2;
+    } else {
+      continue;
+    }
+    auto scale = toIValue(node->input(scale_index));
+    auto zero_point = toIValue(node->input(scale_index + 1));
+    if (!scale || !zero_point) {
+      continue;
+    }
+    QParams output_qparams;
+    output_qparams.scale = scale->toDouble();
+    output_qparams.zero_point = zero_point->toInt();
+    if (kind == quantize_sym) {
+      auto dtype = toIValue(node->input(3));
+      if (!dtype) {
+        continue;
+      }
+      output_qparams.dtype = static_cast<at::ScalarType>(dtype->toInt());
+    } else {
+      output_qparams.dtype = input_dtype(node->input(0));
+    }
+    qparams[node->output()] = output_qparams;
+  }
+  return qparams;
+}
+
+static thread_local const QParamsMap* current_qparams = nullptr;
+
+QParamsGuard::QParamsGuard(const QParamsMap* qparams)
+    : prev_(current_qparams) {
+  current_qparams = qparams;
+}
+
+QParamsGuard::~QParamsGuard() {
+  current_qparams = prev_;
+}
+
+static const QParams& qparamsOfValue(const Value* value) {
+  TORCH_CHECK(current_qparams, "Pytorch TVM: no quantization parameters");
+  auto it = current_qparams->find(value);
+  TORCH_CHECK(
+      it != current_qparams->end(),
+      "Pytorch TVM: unknown quantization parameters of %",
+      value->debugName());
+  return it->second;
+}
+
+static ::tvm::Type storageType(at::ScalarType dtype) {
+  switch (dtype) {
+    case at::kQInt8:
+      return ::tvm::Int(8);
+    case at::kQUInt8:
+      return ::tvm::UInt(8);
+    case at::kQInt32:
+      return ::tvm::Int(32);
+    default:
+      AT_ERROR("Pytorch TVM: unsupported quantized type ", dtype);
+  }
+}
+
+tvm::relay::Function canonicalizeQNN(tvm::relay::Function func) {
+  auto canonicalize_f =
+      tvm::runtime::Registry::Get("relay.qnn._transform.CanonicalizeOps");
+  TORCH_CHECK(canonicalize_f, "Pytorch TVM: QNN is not available");
+  tvm::relay::transform::Pass pass = (*canonicalize_f)();
+  auto mod = pass(tvm::relay::ModuleNode::FromExpr(func));
+  return tvm::Downcast<tvm::relay::Function>(mod->Lookup("main"));
+}
+
+at::Tensor toQuantized(const at::Tensor& int_repr, const QParams& qparams) {
+  return at::_per_tensor_affine_qtensor(
+      int_repr, qparams.scale, qparams.zero_point);
+}
+
+// Unpacks the constant prepacked weight of a quantized linear or conv into
+// the quantized weight and the optional float bias
+static std::pair<at::Tensor, at::Tensor> unpackWeight(const Node* node) {
+  auto packed_ivalue = toIValue(node->input(1));
+  TORCH_CHECK(
+      packed_ivalue, "Pytorch TVM: quantized weights must be constants");
+  auto unpack_op = unpack_ops.at(node->kind());
+  auto ops = getAllOperatorsFor(unpack_op);
+  TORCH_CHECK(
+      ops.size() == 1,
+      "Pytorch TVM: ",
+      unpack_op.toQualString(),
+      " not found");
+  Stack stack{*packed_ivalue};
+  ops[0]->getOperation()(stack);
+  // Older releases do not return the bias
+  at::Tensor bias;
+  if (stack.size() > 1 && stack[1].isTensor()) {
+    bias = stack[1].toTensor();
+  }
+  return {stack[0].toTensor(), bias};
+}
+
+static tvm::relay::Expr constant(const at::Tensor& tensor) {
+  return tvm::relay::ConstantNode::make(toTVMArray(tensor.contiguous()));
+}
+
+// Adds the bias, a float bias quantized to int32 with the accumulator's scale
+// or an int32 bias already at that scale, and requantizes the int32
+// accumulator to the output parameters
+static tvm::relay::Expr requantize(
+    tvm::relay::Expr acc,
+    const at::Tensor& bias,
+    double acc_scale,
+    const QParams& output) {
+  if (bias.defined()) {
+    at::Tensor q_bias;
+    if (bias.is_quantized()) {
+      q_bias = bias.int_repr().to(at::kInt);
+    } else if (bias.is_floating_point()) {
+      q_bias = at::round(bias / acc_scale).to(at::kInt);
+    } else {
+      q_bias = bias.to(at::kInt);
+    }
+    auto bias_add_attrs = tvm::make_node<tvm::relay::BiasAddAttrs>();
+    bias_add_attrs->axis = 1;
+    acc = tvm::relay::CallNode::make(
+        tvm::relay::Op::Get("nn.bias_add"),
+        {acc, constant(q_bias)},
+        tvm::Attrs(bias_add_attrs),
+        {});
+  }
+  auto attrs = tvm::make_node<tvm::relay::qnn::RequantizeAttrs>();
+  attrs->input_scale = acc_scale;
+  attrs->input_zero_point = 0;
+  attrs->output_scale = output.scale;
+  attrs->output_zero_point = output.zero_point;
+  attrs->out_dtype = storageType(output.dtype);
+  return tvm::relay::CallNode::make(
+      tvm::relay::Op::Get("qnn.requantize"), {acc}, tvm::Attrs(attrs), {});
+}
+
+static tvm::Array<tvm::relay::IndexExpr> toIndexArray(const Value* value) {
+  auto ivalue = toIValue(value);
+  TORCH_CHECK(ivalue, "Pytorch TVM: expected a constant list");
+  tvm::Array<tvm::relay::IndexExpr> array;
+  for (auto v : ivalue->toIntListRef()) {
+    array.push_back(static_cast<int32_t>(v));
+  }
+  return array;
+}
+
+// quantized::linear(Tensor X, Tensor W_prepack, float Y_scale_i,
+//                   int Y_zero_point_i)
+// Older releases take the int32 bias separately:
+// quantized::fbgemm_linear(Tensor X, Tensor W_prepack, Tensor b,
+//                          float Y_scale_i, int Y_zero_point_i)
+static tvm::relay::Expr convertLinear(
+    Node* node,
+    tvm::Array<tvm::relay::Expr> inputs) {
+  const auto& input = qparamsOfValue(node->input(0));
+  const auto& output = qparamsOfValue(node->output());
+  auto unpacked = unpackWeight(node);
+  const auto& weight = unpacked.first;
+  if (node->inputs().size() == 5) {
+    auto bias = toIValue(node->input(2));
+    TORCH_CHECK(
+        bias && (bias->isTensor() || bias->isNone()),
+        "Pytorch TVM: the bias of ",
+        node->kind().toQualString(),
+        " must be a constant");
+    if (bias->isTensor()) {
+      unpacked.second = bias->toTensor();
+    }
+  }
+  auto attrs = tvm::make_node<tvm::relay::qnn::QnnDenseAttrs>();
+  attrs->units = static_cast<int32_t>(weight.size(0));
+  attrs->out_dtype = ::tvm::Int(32);
+  attrs->input_zero_point = input.zero_point;
+  attrs->kernel_zero_point = weight.q_zero_point();
+  auto acc = tvm::relay::CallNode::make(
+      tvm::relay::Op::Get("qnn.dense"),
+      {inputs[0], constant(weight.int_repr())},
+      tvm::Attrs(attrs),
+      {});
+  return requantize(
+      acc, unpacked.second, input.scale * weight.q_scale(), output);
+}
+
+// quantized::conv2d(Tensor qx, Tensor weight, int[] stride, int[] padding,
+//                   int[] dilation, int groups, float output_scale,
+//                   int output_zero_point)
+static tvm::relay::Expr convertConv(
+    Node* node,
+    tvm::Array<tvm::relay::Expr> inputs) {
+  const auto& input = qparamsOfValue(node->input(0));
+  const auto& output = qparamsOfValue(node->output());
+  auto unpacked = unpackWeight(node);
+  const auto& weight = unpacked.first;
+  auto groups = toIValue(node->input(5));
+  TORCH_CHECK(groups, "Pytorch TVM: groups must be a constant");
+  auto attrs = tvm::make_node<tvm::relay::qnn::QnnConv2DAttrs>();
+  attrs->strides = toIndexArray(node->input(2));
+  attrs->padding = toIndexArray(node->input(3));
+  attrs->dilation = toIndexArray(node->input(4));
+  attrs->groups = groups->toInt();
+  attrs->channels = static_cast<int32_t>(weight.size(0));
+  attrs->kernel_size = tvm::Array<tvm::relay::IndexExpr>{
+      static_cast<int32_t>(weight.size(2)),
+      static_cast<int32_t>(weight.size(3))};
+  attrs->data_layout = "NCHW";
+  attrs->kernel_layout = "OIHW";
+  attrs->out_dtype = ::tvm::Int(32);
+  attrs->input_zero_point = input.zero_point;
+  attrs->kernel_zero_point = weight.q_zero_point();
+  auto acc = tvm::relay::CallNode::make(
+      tvm::relay::Op::Get("qnn.conv2d"),
+      {inputs[0], constant(weight.int_repr())},
+      tvm::Attrs(attrs),
+      {});
+  return requantize(
+      acc, unpacked.second, input.scale * weight.q_scale(), output);
+}
+
+RegisterTVMOperator reg_quantized({
+    {quantize_sym,
+     [](Node* node, tvm::Array<tvm::relay::Expr> inputs) {
+       const auto& output = qparamsOfValue(node->output());
+       auto attrs = tvm::make_node<tvm::relay::qnn::QuantizeAttrs>();
+       attrs->output_scale = output.scale;
+       attrs->output_zero_point = output.zero_point;
+       attrs->out_dtype = storageType(output.dtype);
+       return tvm::relay::CallNode::make(
+           tvm::relay::Op::Get("qnn.quantize"),
+           {inputs[0]},
+           tvm::Attrs(attrs),
+           {});
+     }},
+    {Symbol::fromQualString("aten::dequantize"),
+     [](Node* node, tvm::Array<tvm::relay::Expr> inputs) {
+       const auto& input = qparamsOfValue(node->input(0));
+       auto attrs = tvm::make_node<tvm::relay::qnn::DequantizeAttrs>();
+       attrs->input_scale = input.scale;
+       attrs->input_zero_point = input.zero_point;
+       return tvm::relay::CallNode::make(
+           tvm::relay::Op::Get("qnn.dequantize"),
+           {inputs[0]},
+           tvm::Attrs(attrs),
+           {});
+     }},
+    {q_relu_sym,
+     [](Node* node, tvm::Array<tvm::relay::Expr> inputs) {
+       // Real zero is represented by the zero point
+       const auto& input = qparamsOfValue(node->input(0));
+       auto attrs = tvm::make_node<tvm::relay::ClipAttrs>();
+       attrs->a_min = input.zero_point;
+       attrs->a_max = input.dtype == at::kQInt8 ? 127 : 255;
+       return tvm::relay::CallNode::make(
+           tvm::relay::Op::Get("clip"), {inputs[0]}, tvm::Attrs(attrs), {});
+     }},
+    {q_add_sym,
+     [](Node* node, tvm::Array<tvm::relay::Expr> inputs) {
+       const auto& lhs = qparamsOfValue(node->input(0));
+       const auto& rhs = qparamsOfValue(node->input(1));
+       const auto& output = qparamsOfValue(node->output());
+       auto attrs = tvm::make_node<tvm::relay::qnn::QnnBinaryOpAttrs>();
+       attrs->lhs_scale = lhs.scale;
+       attrs->lhs_zero_point = lhs.zero_point;
+       attrs->rhs_scale = rhs.scale;
+       attrs->rhs_zero_point = rhs.zero_point;
+       attrs->output_scale = output.scale;
+       attrs->output_zero_point = output.zero_point;
+       return tvm::relay::CallNode::make(
+           tvm::relay::Op::Get("qnn.add"),
+           {inputs[0], inputs[1]},
+           tvm::Attrs(attrs),
+           {});
+     }},
+    {Symbol::fromQualString("quantized::linear"), convertLinear},
+    {Symbol::fromQualString("quantized::fbgemm_linear"), convertLinear},
+    {Symbol::fromQualString("quantized::conv2d"), convertConv},
+    {Symbol::fromQualString("quantized::fbgemm_conv2d"), convertConv},
+});
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <ATen/ATen.h>
+#include <torch/csrc/jit/ir.h>
+#include <tvm/relay/expr.h>
+
+#include <unordered_map>
+#include <vector>
+
+// Per tensor affine quantization parameters.  dtype is kQUInt8, kQInt8 or
+// kQInt32, or Undefined for values that are not quantized.
+struct QParams {
+  double scale = 0;
+  int64_t zero_point = 0;
+  at::ScalarType dtype = at::ScalarType::Undefined;
+
+  bool quantized() const {
+    return dtype != at::ScalarType::Undefined;
+  }
+  bool operator==(const QParams& other) const {
+    return scale == other.scale && zero_point == other.zero_point &&
+        dtype == other.dtype;
+  }
+};
+
+using QParamsMap = std::unordered_map<const torch::jit::Value*, QParams>;
+
+// Propagates the quantization parameters of inputs through subgraph.  The
+// parameters of values computed by quantized operators come from their
+// constant output scale and zero point arguments.
+QParamsMap inferQParams(
+    const torch::jit::Graph& subgraph,
+    at::ArrayRef<c10::IValue> inputs);
+
+// Makes qparams visible to the quantized operator converters run on this
+// thread for the lifetime of the guard
+struct QParamsGuard {
+  explicit QParamsGuard(const QParamsMap* qparams);
+  ~QParamsGuard();
+
+ private:
+  const QParamsMap* prev_;
+};
+
+// Lowers the QNN operators of func to regular Relay operators
+tvm::relay::Function canonicalizeQNN(tvm::relay::Function func);
+
+// The parameters of each of tensors, Undefined for non-quantized ones
+std::vector<QParams> qparamsOf(at::ArrayRef<c10::IValue> tensors);
+// Reinterprets the integer representation of a quantized tensor
+at::Tensor toQuantized(const at::Tensor& int_repr, const QParams& qparams);
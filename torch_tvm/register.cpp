@@ -1,4 +1,5 @@
 #include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
 #include <torch/csrc/autograd/record_function.h>
 #include <torch/csrc/jit/custom_operator.h>
 #include <torch/csrc/jit/operator_options.h>
@@ -6,9 +7,19 @@
 #include <torch/csrc/jit/passes/graph_fuser.h>
 #include <torch/csrc/jit/pybind_utils.h>
 
+#include "allocator.h"
 #include "compiler.h"
+#include "dispatch.h"
 #include "operators.h"
 #include "fuse_linear.h"
+#include "fusion_policy.h"
+#include "inplace.h"
+#include "layout.h"
+#include "mixed_precision.h"
+#include "profiling.h"
+
+#include <algorithm>
+#include <sstream>
 
 namespace py = pybind11;
 using namespace torch::jit;
@@ -23,27 +34,65 @@ static int opt_level = 2;
 static std::string device_type = "cpu";
 static std::string device = "llvm -mcpu=core-avx2";
 static std::string host = "llvm -mcpu=core-avx2";
+// directory of the on-disk compilation cache, empty disables it
+static std::string cache_dir = "";
+// compile new shapes in the background, running the JIT until they are ready
+static bool async_compile = false;
+// pad inputs up to bucket shapes to bound the number of compiled kernels
+static BucketingPolicy bucketing;
+// tiered compilation, disabled if hot_threshold is 0
+static int hot_threshold = 0;
+static int tier0_opt_level = 0;
+// profile guided dispatch between TVM and the JIT, disabled if 0
+static int profile_runs = 0;
+// compilation groups rejected by the policy are dissolved back into the graph
+static FusionPolicy fusion_policy;
+// channel block of the NCHW[x]c layout kept between adjacent groups, 0
+// passes NCHW
+static int64_t nchwc_block = 0;
+// compute precision of convolutions and dense layers
+static std::string precision = "fp32";
 static auto tvm_sym = Symbol::fromQualString("tvm::CompilationGroup");
+// compilation groups updating their inputs in place
+static auto tvm_inplace_sym =
+    Symbol::fromQualString("tvm::CompilationGroupInPlace");
 
 static std::unordered_map<size_t, tvm::relay::Expr> relay_exprs;
 static size_t relay_exprs_uuid = 0;
 
+static Operation createCompilationGroup(const Node* node) {
+  auto cc = std::make_shared<TVMCompiler>(
+      node,
+      opt_level,
+      strict,
+      device_type,
+      device,
+      host,
+      cache_dir,
+      async_compile,
+      bucketing,
+      hot_threshold,
+      tier0_opt_level,
+      profile_runs,
+      precision);
+  registerCompiler(cc);
+  return [cc](Stack& stack) {
+    RECORD_FUNCTION("TVM", std::vector<c10::IValue>());
+    cc->run(stack);
+    return 0;
+  };
+}
+
 PYBIND11_MODULE(_torch_tvm, m) {
-  // Register the tvm::CompilationGroup operator
+  // Register the tvm::CompilationGroup operator, and the variant writing to
+  // its inputs, which must not be removed or reordered as a pure operator
   auto options = c10::OperatorOptions();
   options.setAliasAnalysis(AliasAnalysisKind::PURE);
-  RegisterOperators op({Operator(
-      tvm_sym,
-      [](const Node* node) {
-        auto cc = std::make_shared<TVMCompiler>(
-            node, opt_level, strict, device_type, device, host);
-        return [cc](Stack& stack) {
-          RECORD_FUNCTION("TVM", std::vector<c10::IValue>());
-          cc->run(stack);
-          return 0;
-        };
-      },
-      options)});
+  auto inplace_options = c10::OperatorOptions();
+  inplace_options.setAliasAnalysis(AliasAnalysisKind::CONSERVATIVE);
+  RegisterOperators op(
+      {Operator(tvm_sym, createCompilationGroup, options),
+       Operator(tvm_inplace_sym, createCompilationGroup, inplace_options)});
 
   // Register the pass that fuses parts of the graph into
   // a tvm::CompilationGroup
@@ -51,6 +100,12 @@ PYBIND11_MODULE(_torch_tvm, m) {
     if (fusion_enabled) {
       FuseLinear(g);
       CustomFuseGraph(g, isSupported, tvm_sym);
+      DissolveSmallGroups(g, tvm_sym, fusion_policy);
+      MarkInPlaceOutputs(g, tvm_sym);
+      if (nchwc_block > 0) {
+        MarkBlockedLayout(g, tvm_sym, nchwc_block);
+      }
+      SeparateInPlaceGroups(g, tvm_sym, tvm_inplace_sym);
     }
   });
 
@@ -61,22 +116,226 @@ PYBIND11_MODULE(_torch_tvm, m) {
          bool strict_,
          std::string device_type_,
          std::string device_,
-         std::string host_) {
+         std::string host_,
+         std::string cache_dir_,
+         bool async_compile_,
+         int compile_threads_,
+         std::vector<int64_t> bucket_dims_,
+         std::unordered_map<int64_t, std::vector<int64_t>> buckets_,
+         int64_t cache_budget_,
+         std::string thread_pool_,
+         int hot_threshold_,
+         int tier0_opt_level_,
+         bool record_workloads_,
+         py::object tuning_log_,
+         int profile_runs_,
+         std::string dispatch_table_,
+         int64_t min_group_size_,
+         int64_t min_group_flops_,
+         py::object group_filter_,
+         int64_t nchwc_block_,
+         std::string precision_,
+         bool shared_workspace_,
+         bool profile_ops_) {
         fusion_enabled = true;
         strict = strict_;
         opt_level = opt_level_;
         device_type = device_type_;
         device = device_;
         host = host_;
+        cache_dir = cache_dir_;
+        async_compile = async_compile_;
+        setCompileThreads(compile_threads_);
+        bucketing = BucketingPolicy();
+        for (auto dim : bucket_dims_) {
+          bucketing.buckets[dim] = {};
+        }
+        for (auto& kv : buckets_) {
+          std::sort(kv.second.begin(), kv.second.end());
+          bucketing.buckets[kv.first] = kv.second;
+        }
+        KernelCacheManager::get().setBudget(cache_budget_);
+        AT_CHECK(
+            thread_pool_ == "tvm" || thread_pool_ == "aten",
+            "thread_pool must be \"tvm\" or \"aten\", got ",
+            thread_pool_);
+        setShareATenThreads(thread_pool_ == "aten");
+        AT_CHECK(hot_threshold_ >= 0, "hot_threshold must be non-negative");
+        hot_threshold = hot_threshold_;
+        tier0_opt_level = tier0_opt_level_;
+        setRecordWorkloads(record_workloads_);
+        AT_CHECK(profile_runs_ >= 0, "profile_runs must be non-negative");
+        profile_runs = profile_runs_;
+        DispatchTable::get().setPath(dispatch_table_);
+        AT_CHECK(nchwc_block_ >= 0, "nchwc_block must be non-negative");
+        nchwc_block = nchwc_block_;
+        checkPrecision(precision_);
+        precision = precision_;
+        setSharedWorkspace(shared_workspace_);
+        setProfileOps(profile_ops_);
+        fusion_policy = FusionPolicy();
+        fusion_policy.min_nodes = min_group_size_;
+        fusion_policy.min_flops = min_group_flops_;
+        if (!group_filter_.is_none()) {
+          // The fusion pass runs without the GIL, and may outlive the
+          // interpreter at exit
+          std::shared_ptr<py::object> filter(
+              new py::object(group_filter_), [](py::object* f) {
+                if (Py_IsInitialized()) {
+                  py::gil_scoped_acquire gil;
+                  delete f;
+                }
+              });
+          fusion_policy.filter = [filter](std::shared_ptr<Graph> subgraph) {
+            py::gil_scoped_acquire gil;
+            return py::cast<bool>((*filter)(subgraph));
+          };
+        }
+        // AutoTVM's dispatch context lives in Python and is global, so
+        // entering it once applies to builds on any thread.  The log applied
+        // by an earlier call or by tune() is kept unless one is given.
+        if (!tuning_log_.is_none()) {
+          auto apply_f =
+              tvm::runtime::Registry::Get("torch_tvm._apply_tuning_log");
+          AT_CHECK(
+              apply_f,
+              "Pytorch TVM: torch_tvm._apply_tuning_log is not registered");
+          (*apply_f)(py::cast<std::string>(tuning_log_));
+        }
       },
       py::arg("opt_level") = 2,
       py::arg("strict") = false,
       py::arg("device_type") = "cpu",
       py::arg("device") = "llvm -mcpu=core-avx2",
-      py::arg("host") = "llvm -mcpu=core-avx2");
+      py::arg("host") = "llvm -mcpu=core-avx2",
+      py::arg("cache_dir") = "",
+      py::arg("async_compile") = false,
+      py::arg("compile_threads") = 1,
+      py::arg("bucket_dims") = std::vector<int64_t>(),
+      py::arg("buckets") = std::unordered_map<int64_t, std::vector<int64_t>>(),
+      py::arg("cache_budget") = 0,
+      py::arg("thread_pool") = "tvm",
+      py::arg("hot_threshold") = 0,
+      py::arg("tier0_opt_level") = 0,
+      py::arg("record_workloads") = false,
+      py::arg("tuning_log") = py::none(),
+      py::arg("profile_runs") = 0,
+      py::arg("dispatch_table") = "",
+      py::arg("min_group_size") = 1,
+      py::arg("min_group_flops") = 0,
+      py::arg("group_filter") = py::none(),
+      py::arg("nchwc_block") = 0,
+      py::arg("precision") = "fp32",
+      py::arg("shared_workspace") = false,
+      py::arg("profile_ops") = false);
 
   m.def("disable", []() { fusion_enabled = false; });
 
+  // python API to count executions that bailed out to the JIT
+  m.def("fallback_stats", []() {
+    auto stats = fallbackStats();
+    py::dict d;
+    d["conversion_failures"] = stats.conversion_failures;
+    d["fallback_calls"] = stats.fallback_calls;
+    d["profile_calls"] = stats.profile_calls;
+    return d;
+  });
+
+  // python API to inspect the memory held by compiled kernels
+  m.def("cache_stats", []() {
+    auto stats = KernelCacheManager::get().stats();
+    py::list groups;
+    for (const auto& group : stats.groups) {
+      py::dict g;
+      g["id"] = group.id;
+      g["ops"] = group.ops;
+      g["bytes"] = group.bytes;
+      g["kernels"] = group.kernels;
+      g["evictions"] = group.evictions;
+      groups.append(g);
+    }
+    py::dict d;
+    d["budget"] = stats.budget;
+    d["bytes"] = stats.bytes;
+    d["evictions"] = stats.evictions;
+    d["groups"] = groups;
+    return d;
+  });
+
+  // python API to monitor tiered compilation
+  m.def("spec_stats", []() {
+    py::list specs;
+    for (const auto& stats : allSpecStats()) {
+      py::dict d;
+      d["group"] = stats.group_id;
+      d["ops"] = stats.group_ops;
+      d["shapes"] = stats.shapes;
+      d["tier"] = stats.tier;
+      d["calls"] = stats.calls;
+      specs.append(d);
+    }
+    return specs;
+  });
+
+  // python API to inspect the decisions of profile guided dispatch
+  m.def("dispatch_table", []() {
+    py::list entries;
+    for (const auto& kv : DispatchTable::get().entries()) {
+      std::ostringstream key;
+      key << std::hex << kv.first;
+      py::dict d;
+      d["key"] = key.str();
+      d["ops"] = kv.second.ops;
+      d["tvm_us"] = kv.second.tvm_us;
+      d["jit_us"] = kv.second.jit_us;
+      d["backend"] = kv.second.use_tvm ? "tvm" : "jit";
+      entries.append(d);
+    }
+    return entries;
+  });
+
+  // python API to inspect the arena backing TVM's CPU allocations
+  m.def("allocator_stats", []() {
+    auto stats = CPUArena::get().stats();
+    py::dict d;
+    d["allocations"] = stats.allocations;
+    d["reserved_bytes"] = stats.reserved_bytes;
+    d["used_bytes"] = stats.used_bytes;
+    d["workspace_bytes"] = workspaceBytes();
+    return d;
+  });
+  m.def("empty_allocator_cache", []() { CPUArena::get().emptyCache(); });
+  // Whether a tensor is a kernel output the next kernel binds as is
+  m.def("_is_tvm_array", [](const at::Tensor& tensor) {
+    return isTVMArray(tensor);
+  });
+
+  // python API backing torch_tvm.profile
+  m.def("_kernel_times", [](int64_t id) {
+    py::list kernels;
+    for (const auto& kernel : kernelTimes(id)) {
+      py::dict d;
+      d["kernel"] = kernel.kernel;
+      d["nodes"] = kernel.nodes;
+      d["source"] = kernel.source;
+      d["us"] = kernel.us;
+      kernels.append(d);
+    }
+    return kernels;
+  });
+  m.def("_clear_kernel_times", []() { clearKernelTimes(); });
+
+  // python API backing torch_tvm.export and torch_tvm.load
+  m.def("_start_recording", []() { startRecordingArtifacts(); });
+  m.def("_stop_recording", []() { stopRecordingArtifacts(); });
+  m.def("_recorded_calls", []() { return recordedArtifactCalls(); });
+  m.def("_write_archive", [](const std::string& path) {
+    return writeArchive(path);
+  });
+  m.def("load_archive", [](const std::string& path) {
+    return loadArchive(path);
+  });
+
   m.def(
       "_push_relay_expr",
       [](std::shared_ptr<Graph> g, std::vector<at::Tensor> inputs) {
@@ -88,7 +347,7 @@ PYBIND11_MODULE(_torch_tvm, m) {
             count == 1,
             "This program cannot be exported as a single Relay expression.");
         for (auto node : g->nodes()) {
-          if (node->kind() == tvm_sym) {
+          if (node->kind() == tvm_sym || node->kind() == tvm_inplace_sym) {
             std::vector<Value*> v;
             auto subgraph = node->g(attr::Subgraph);
             TORCH_CHECK(
@@ -117,6 +376,23 @@ PYBIND11_MODULE(_torch_tvm, m) {
   m.doc() = "This module does nothing but register a TVM backend.";
 }
 
+TVM_REGISTER_GLOBAL("torch_tvm._recorded_workloads")
+    .set_body([](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+      *rv = recordedWorkloads();
+    });
+
+TVM_REGISTER_GLOBAL("torch_tvm._clear_recorded_workloads")
+    .set_body([](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+      clearRecordedWorkloads();
+    });
+
+// Called with the path of the tuning log applied to builds, empty if none
+TVM_REGISTER_GLOBAL("torch_tvm._set_tuning_log")
+    .set_body([](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
+      std::string path = args[0];
+      setTuningLog(path);
+    });
+
 TVM_REGISTER_GLOBAL("torch_tvm._pop_relay_expr")
     .set_body([](tvm::runtime::TVMArgs args, tvm::runtime::TVMRetValue* rv) {
       size_t id = args[0];
@@ -0,0 +1,166 @@
+#include "workspace.h"
+#include "kernel_cache.h"
+
+#include <c10/core/CPUAllocator.h>
+#include <dmlc/logging.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+static std::atomic<bool> shared_workspace{false};
+static std::atomic<int64_t> workspace_bytes{0};
+
+// Alignment of pool entries in the slab
+static constexpr int64_t kAlignment = 64;
+
+void setSharedWorkspace(bool enabled) {
+  shared_workspace = enabled;
+}
+
+bool sharedWorkspace() {
+  return shared_workspace.load(std::memory_order_relaxed);
+}
+
+WorkspaceSlab::~WorkspaceSlab() {
+  workspace_bytes -= size;
+}
+
+int64_t workspaceBytes() {
+  return workspace_bytes;
+}
+
+WorkspacePlan planWorkspace(const std::string& graph_json) {
+  WorkspacePlan plan;
+  std::vector<int> storage_ids;
+  std::vector<int64_t> arg_nodes;
+  std::vector<int64_t> node_row_ptr;
+  if (!graphStoragePool(graph_json, &storage_ids, &plan.pool_bytes) ||
+      !readGraphArray(graph_json, "arg_nodes", &arg_nodes) ||
+      !readGraphArray(graph_json, "node_row_ptr", &node_row_ptr)) {
+    return WorkspacePlan();
+  }
+  // Parameters are loaded once and must outlive the run, and inputs are
+  // usually bound zero copy, so neither is worth sharing
+  std::unordered_set<int> private_ids;
+  for (auto nid : arg_nodes) {
+    if (nid >= static_cast<int64_t>(node_row_ptr.size()) ||
+        node_row_ptr[nid] >= static_cast<int64_t>(storage_ids.size())) {
+      return WorkspacePlan();
+    }
+    private_ids.insert(storage_ids[node_row_ptr[nid]]);
+  }
+  for (size_t sid = 0; sid < plan.pool_bytes.size(); ++sid) {
+    if (private_ids.count(sid)) {
+      plan.offsets.push_back(-1);
+      plan.private_bytes += plan.pool_bytes[sid];
+      continue;
+    }
+    plan.offsets.push_back(plan.slab_bytes);
+    plan.slab_bytes +=
+        (plan.pool_bytes[sid] + kAlignment - 1) / kAlignment * kAlignment;
+  }
+  return plan;
+}
+
+namespace {
+
+// The slabs created by a thread, including those replaced by a larger one
+// but still holding runtimes
+struct ThreadSlabs {
+  ~ThreadSlabs() {
+    for (const auto& created_slab : created) {
+      if (auto slab = created_slab.lock()) {
+        slab->orphaned = true;
+      }
+    }
+  }
+
+  std::shared_ptr<WorkspaceSlab> current;
+  std::vector<std::weak_ptr<WorkspaceSlab>> created;
+};
+
+} // namespace
+
+std::shared_ptr<WorkspaceSlab> threadWorkspace(int64_t bytes) {
+  thread_local ThreadSlabs slabs;
+  auto& slab = slabs.current;
+  if (!slab || static_cast<int64_t>(slab->size) < bytes) {
+    slab = std::make_shared<WorkspaceSlab>();
+    slab->data = c10::GetCPUAllocator()->allocate(bytes);
+    slab->size = bytes;
+    slab->owner = std::this_thread::get_id();
+    workspace_bytes += bytes;
+    auto& created = slabs.created;
+    created.erase(
+        std::remove_if(
+            created.begin(),
+            created.end(),
+            [](const std::weak_ptr<WorkspaceSlab>& s) { return s.expired(); }),
+        created.end());
+    created.push_back(slab);
+  }
+  return slab;
+}
+
+// Pointers handed out from slabs.  Runtimes placed in the same slab share
+// pointers, and may be destroyed on any thread.
+static std::mutex placed_mutex;
+static std::unordered_map<void*, int64_t> placed;
+
+// Placement of the runtime being created on this thread
+struct Placement {
+  const WorkspacePlan* plan = nullptr;
+  WorkspaceSlab* slab = nullptr;
+  size_t next = 0;
+};
+static thread_local Placement placement;
+
+WorkspacePlacementGuard::WorkspacePlacementGuard(
+    const WorkspacePlan& plan,
+    WorkspaceSlab& slab) {
+  placement.plan = &plan;
+  placement.slab = &slab;
+  placement.next = 0;
+}
+
+WorkspacePlacementGuard::~WorkspacePlacementGuard() {
+  placement = Placement();
+}
+
+void* placeAllocation(size_t nbytes) {
+  if (!placement.plan || placement.next >= placement.plan->offsets.size()) {
+    return nullptr;
+  }
+  const auto& plan = *placement.plan;
+  auto index = placement.next++;
+  if (plan.pool_bytes[index] != static_cast<int64_t>(nbytes)) {
+    // The runtime does not allocate as planned, give up on placing it
+    LOG(WARNING) << "Pytorch TVM: unexpected storage allocation of " << nbytes
+                 << " bytes, not using the shared workspace\n";
+    placement = Placement();
+    return nullptr;
+  }
+  if (plan.offsets[index] < 0) {
+    return nullptr;
+  }
+  void* ptr =
+      static_cast<char*>(placement.slab->data.get()) + plan.offsets[index];
+  std::lock_guard<std::mutex> guard(placed_mutex);
+  placed[ptr]++;
+  return ptr;
+}
+
+bool releasePlacedAllocation(void* ptr) {
+  std::lock_guard<std::mutex> guard(placed_mutex);
+  auto it = placed.find(ptr);
+  if (it == placed.end()) {
+    return false;
+  }
+  if (--it->second == 0) {
+    placed.erase(it);
+  }
+  return true;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <c10/core/Allocator.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Compilation groups called from one thread run one after another, and the
+// intermediate storage of a GraphRuntime is only live during its run.  With
+// a shared workspace, the storage of every runtime created by a thread is
+// placed at the start of that thread's slab, so a thread holds the storage
+// of its largest group rather than the sum over all groups.
+struct WorkspaceSlab {
+  ~WorkspaceSlab();
+
+  c10::DataPtr data;
+  size_t size;
+  // Runtimes placed in the slab may only run on this thread
+  std::thread::id owner;
+  // Set when the owner exits.  Runtimes placed in the slab can no longer
+  // run and are reclaimed, freeing the slab with the last of them.
+  std::atomic<bool> orphaned{false};
+};
+
+// Placement of the storage pool of a graph in a slab
+struct WorkspacePlan {
+  // Bytes of each pool entry, in allocation order
+  std::vector<int64_t> pool_bytes;
+  // Offset of each pool entry in the slab, -1 for entries holding inputs or
+  // parameters, which keep their own memory
+  std::vector<int64_t> offsets;
+  int64_t slab_bytes = 0;
+  // Bytes of the entries keeping their own memory
+  int64_t private_bytes = 0;
+
+  bool enabled() const {
+    return slab_bytes > 0;
+  }
+};
+
+void setSharedWorkspace(bool enabled);
+bool sharedWorkspace();
+
+// Returns a disabled plan if graph_json cannot be parsed
+WorkspacePlan planWorkspace(const std::string& graph_json);
+
+// The calling thread's slab, replaced by a larger one if smaller than bytes.
+// Runtimes keep the slab they were placed in alive.  The slabs of a thread
+// are orphaned when it exits.
+std::shared_ptr<WorkspaceSlab> threadWorkspace(int64_t bytes);
+
+// Bytes held by the slabs of all threads
+int64_t workspaceBytes();
+
+// Places the storage pool of the GraphRuntime created on this thread during
+// the lifetime of the guard in slab
+struct WorkspacePlacementGuard {
+  WorkspacePlacementGuard(const WorkspacePlan& plan, WorkspaceSlab& slab);
+  ~WorkspacePlacementGuard();
+};
+
+// Called by the CPU device API.  Returns the memory of the next pool entry
+// if it is placed in a slab, null otherwise.
+void* placeAllocation(size_t nbytes);
+// Returns true if ptr was placed in a slab, which owns its memory
+bool releasePlacedAllocation(void* ptr);